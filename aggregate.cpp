@@ -0,0 +1,664 @@
+// Summarize the throughput samples of benchmark runs per configuration, and
+// optionally compare them against a baseline to detect regressions.
+//
+// Inputs are either results files written by `bench` (JSONL), in which case a
+// configuration is the set of matrix parameters of a "bench_run" record and
+// its samples are the "sent_MB_per_second" fields (or those named by --field)
+// of the run's "sample" records, or text logs named
+// "<mode>-<family>-<pages>.log" as formerly written by collect.sh, whose third
+// column is the throughput in MB/s.
+// Samples of failed runs are ignored.
+//
+// For each configuration, print the number of samples, their mean, standard
+// deviation, median, 5th and 95th percentiles, and a bootstrap 95% confidence
+// interval of the mean. Samples from one run are correlated, so the bootstrap
+// resamples runs, and then blocks of consecutive samples within each run.
+// Differences between runs only show in the interval if there are several
+// repetitions of each configuration, so gate on results of at least two.
+//
+// With --baseline, the confidence interval of the relative change of the mean
+// of each configuration present in both is computed the same way. A
+// configuration regressed if the whole interval lies below -tolerance, i.e.
+// it is likely slower than the baseline by more than the tolerance (or, with
+// --lower-is-better, if the whole interval lies above the tolerance). The exit
+// status is then 1, so that e.g. a kernel upgrade can be gated on
+//
+//     ./aggregate --baseline=old.jsonl --where=family=tcp new.jsonl
+//
+// With --by=<parameter>, write the summaries to files instead, one line per
+// value of the parameter, for plotting; e.g. the latency under increasing
+// load of runs with `--rate` is written by
+//
+//     ./aggregate --by=rate --field=latency_p99_microseconds latency.jsonl
+//
+// and with two parameters, e.g. --by=connections,threads, lines are blocks of
+// a grid for surface plots.
+//
+// With --per=<parameter>, print instead, for each configuration and each
+// value of the parameter above the lowest nonzero one, what each unit of it
+// adds to the mean compared to that value, with the bootstrap 95% confidence
+// interval of that, e.g. the latency and CPU time that each forwarding hop
+// adds by
+//
+//     ./aggregate --per=hops --field=latency_p50_microseconds chain.jsonl
+//
+// Zero is not the baseline, since it tends to be a different setup, e.g. with
+// hops=0 there is no backend, whose cost would be counted as the first hop's.
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "json.h"
+
+namespace fs = std::filesystem;
+
+void usage(std::ostream &out, const char *argv0) {
+  out << "usage: " << argv0
+      << " [options] <results.jsonl | mode-family-pages.log | directory>...\n"
+         "\nOptions:\n"
+         "  --baseline=<path>       compare with this results file, log, or "
+         "directory of\n"
+         "                          them (may be repeated)\n"
+         "  --tolerance=<percent>   ignore regressions smaller than this "
+         "(default: 1)\n"
+         "  --where=<key>=<values>  only configurations whose <key> is one "
+         "of the\n"
+         "                          comma-separated <values> (may be "
+         "repeated)\n"
+         "  --field=<name>          summarize this field of the samples "
+         "(default:\n"
+         "                          sent_MB_per_second)\n"
+         "  --lower-is-better       an increase of the field is a "
+         "regression\n"
+         "  --by=<parameter>        write \"<value> <mean> <sd> ...\" to a "
+         "file named\n"
+         "                          after the other parameters that differ, "
+         "e.g.\n"
+         "                          splicetee-tcp.by-pages\n"
+         "  --by=<param1>,<param2>  write \"<value1> <value2> <mean> ...\" "
+         "in blocks by\n"
+         "                          <param1>, for surface plots\n"
+         "  --by-pages              same as --by=pages\n"
+         "  --per=<parameter>       print what each unit of the parameter "
+         "adds to the\n"
+         "                          mean, compared to its lowest nonzero "
+         "value\n"
+         "  --resamples=<count>     bootstrap resamples (default: 2000)\n";
+}
+
+// Keys of a "bench_run" record that describe the run rather than its
+// configuration.
+constexpr std::string_view run_keys[] = {
+    "type",   "run_id",    "repetition",   "cpus",
+    "status", "exit_code", "wall_seconds", "stderr",
+};
+
+using Parameters = std::vector<std::pair<std::string, std::string>>;
+
+std::optional<double> parse_double(std::string_view text) {
+  double value;
+  const auto [end, err] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  if (err != std::errc() || end != text.data() + text.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+// Order parameter lists by their values, comparing numbers numerically, so
+// that e.g. pages=2 comes before pages=10.
+bool less_parameters(const Parameters &left, const Parameters &right) {
+  for (std::size_t i = 0; i < left.size() && i < right.size(); ++i) {
+    if (left[i].first != right[i].first) {
+      return left[i].first < right[i].first;
+    }
+    const auto l = parse_double(left[i].second);
+    const auto r = parse_double(right[i].second);
+    if (l && r) {
+      if (*l != *r) {
+        return *l < *r;
+      }
+    } else if (left[i].second != right[i].second) {
+      return left[i].second < right[i].second;
+    }
+  }
+  return left.size() < right.size();
+}
+
+struct LessParameters {
+  bool operator()(const Parameters &left, const Parameters &right) const {
+    return less_parameters(left, right);
+  }
+};
+
+// Throughput samples of each run of each configuration, in order.
+using Runs = std::vector<std::vector<double>>;
+using Configurations = std::map<Parameters, Runs, LessParameters>;
+
+// Read the values of `field` in the "bench" results file at `path` into
+// `configurations`. Return
+// whether the file could be read.
+bool read_results(const fs::path &path, std::string_view field,
+                  Configurations &configurations) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Unable to open " << path << '\n';
+    return false;
+  }
+  // Runs of the configuration of each successful run, and the run's index
+  // among them, keyed by run ID.
+  std::map<std::string, std::pair<Runs *, std::size_t>> runs;
+  int line_number = 0;
+  for (std::string line; std::getline(in, line);) {
+    ++line_number;
+    const auto record = json_parse_flat(line);
+    if (!record) {
+      std::cerr << path.native() << ':' << line_number
+                << ": not a flat JSON object; ignoring it\n";
+      continue;
+    }
+    const std::string *const type = json_find(*record, "type");
+    const std::string *const run_id = json_find(*record, "run_id");
+    if (!type || !run_id) {
+      continue;
+    }
+    if (*type == "bench_run") {
+      const std::string *const status = json_find(*record, "status");
+      if (status && *status != "ok") {
+        continue;
+      }
+      Parameters parameters;
+      for (const auto &[key, value] : *record) {
+        if (std::ranges::find(run_keys, key) == std::end(run_keys)) {
+          parameters.emplace_back(key, value);
+        }
+      }
+      Runs &config_runs = configurations[parameters];
+      runs[*run_id] = {&config_runs, config_runs.size()};
+      config_runs.emplace_back();
+    } else if (*type == "sample") {
+      const auto run = runs.find(*run_id);
+      const std::string *const text = json_find(*record, field);
+      if (run == runs.end() || !text) {
+        continue;
+      }
+      if (const auto value = parse_double(*text)) {
+        const auto [config_runs, index] = run->second;
+        (*config_runs)[index].push_back(*value);
+      }
+    }
+  }
+  return true;
+}
+
+// Read the text log at `path`, named "<mode>-<family>-<pages>.log", into
+// `configurations`. Return whether the file could be read.
+bool read_log(const fs::path &path, Configurations &configurations) {
+  const std::string stem = path.stem();
+  const auto first = stem.find('-');
+  const auto last = stem.rfind('-');
+  if (first == std::string::npos || first == last) {
+    std::cerr << path << " is not named <mode>-<family>-<pages>.log\n";
+    return false;
+  }
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Unable to open " << path << '\n';
+    return false;
+  }
+  const Parameters parameters = {
+      {"mode", stem.substr(0, first)},
+      {"family", stem.substr(first + 1, last - first - 1)},
+      {"pages", stem.substr(last + 1)},
+  };
+  std::vector<double> samples;
+  for (std::string line; std::getline(in, line);) {
+    std::istringstream columns(line);
+    std::string milliseconds, unit, throughput;
+    columns >> milliseconds >> unit >> throughput;
+    if (const auto value = parse_double(throughput)) {
+      samples.push_back(*value);
+    }
+  }
+  configurations[parameters].push_back(std::move(samples));
+  return true;
+}
+
+// Return the specified `fraction` quantile of the specified sorted `values`,
+// interpolating linearly between adjacent values.
+double quantile(const std::vector<double> &values, double fraction) {
+  if (values.empty()) {
+    return NAN;
+  }
+  const double position = fraction * (values.size() - 1);
+  const std::size_t below = std::size_t(position);
+  const std::size_t above = std::min(below + 1, values.size() - 1);
+  return values[below] + (position - below) * (values[above] - values[below]);
+}
+
+// Return the mean of a resample of the specified `runs`: as many runs drawn
+// with replacement, each replaced by as many samples drawn as consecutive
+// blocks of about the cube root of its length.
+double resampled_mean(const Runs &runs, std::mt19937_64 &random) {
+  std::uniform_int_distribution<std::size_t> pick_run(0, runs.size() - 1);
+  double sum = 0;
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < runs.size(); ++i) {
+    const std::vector<double> &run = runs[pick_run(random)];
+    if (run.empty()) {
+      continue;
+    }
+    const std::size_t block =
+        std::max<std::size_t>(1, std::lround(std::cbrt(run.size())));
+    std::uniform_int_distribution<std::size_t> pick_start(
+        0, run.size() - block);
+    for (std::size_t taken = 0; taken < run.size();) {
+      const std::size_t start = pick_start(random);
+      for (std::size_t j = start; j < start + block && taken < run.size();
+           ++j, ++taken) {
+        sum += run[j];
+      }
+    }
+    count += run.size();
+  }
+  return count ? sum / count : NAN;
+}
+
+struct Summary {
+  std::size_t runs = 0;
+  std::size_t samples = 0;
+  double mean = NAN;
+  double sd = NAN;
+  double median = NAN;
+  double p5 = NAN;
+  double p95 = NAN;
+  double ci_low = NAN;
+  double ci_high = NAN;
+};
+
+Summary summarize(const Runs &runs, int resamples) {
+  Summary summary;
+  std::vector<double> all;
+  for (const auto &run : runs) {
+    all.insert(all.end(), run.begin(), run.end());
+    summary.runs += !run.empty();
+  }
+  summary.samples = all.size();
+  if (all.empty()) {
+    return summary;
+  }
+  double sum = 0;
+  for (const double value : all) {
+    sum += value;
+  }
+  summary.mean = sum / all.size();
+  if (all.size() > 1) {
+    double squares = 0;
+    for (const double value : all) {
+      squares += (value - summary.mean) * (value - summary.mean);
+    }
+    summary.sd = std::sqrt(squares / (all.size() - 1));
+  }
+  std::sort(all.begin(), all.end());
+  summary.median = quantile(all, 0.5);
+  summary.p5 = quantile(all, 0.05);
+  summary.p95 = quantile(all, 0.95);
+
+  std::mt19937_64 random;
+  std::vector<double> means;
+  for (int i = 0; i < resamples; ++i) {
+    means.push_back(resampled_mean(runs, random));
+  }
+  std::sort(means.begin(), means.end());
+  summary.ci_low = quantile(means, 0.025);
+  summary.ci_high = quantile(means, 0.975);
+  return summary;
+}
+
+// Return the bootstrap 95% confidence interval of the relative change of the
+// mean from `baseline` to `current`.
+std::pair<double, double> change_interval(const Runs &baseline,
+                                          const Runs &current, int resamples) {
+  std::mt19937_64 random;
+  std::vector<double> changes;
+  for (int i = 0; i < resamples; ++i) {
+    const double before = resampled_mean(baseline, random);
+    changes.push_back(resampled_mean(current, random) / before - 1);
+  }
+  std::sort(changes.begin(), changes.end());
+  return {quantile(changes, 0.025), quantile(changes, 0.975)};
+}
+
+std::string label(const Parameters &parameters) {
+  std::string result;
+  for (const auto &[key, value] : parameters) {
+    if (!result.empty()) {
+      result += ' ';
+    }
+    result += key + '=' + value;
+  }
+  return result;
+}
+
+// Read the results file or log at `path`, or every "*.log" and "*.jsonl" file
+// in the directory at `path`, into `configurations`. Return whether all could
+// be read. Logs hold only throughput, so `field` applies to results files.
+bool read_input(const fs::path &path, std::string_view field,
+                Configurations &configurations) {
+  if (fs::is_directory(path)) {
+    for (const auto &entry : fs::directory_iterator(path)) {
+      const auto extension = entry.path().extension();
+      if ((extension == ".log" || extension == ".jsonl") &&
+          !read_input(entry.path(), field, configurations)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  if (path.extension() == ".log") {
+    return read_log(path, configurations);
+  }
+  return read_results(path, field, configurations);
+}
+
+// Write the summaries of `configurations` that have the parameters `by` to
+// files named after the values of the other parameters that differ between
+// them, e.g. "splicetee-tcp.by-pages" for a sweep over modes and families,
+// one line per value of `by`, for plotting with e.g. by-pages.plot. If no
+// other parameter differs, the file is named after all of them. With
+// several parameters, e.g. "connections-threads", each line begins with the
+// value of each, and lines are separated into blocks by the first, so that
+// gnuplot's `splot` draws them as a surface.
+void write_by(const Configurations &configurations,
+              const std::vector<std::string> &by, int resamples) {
+  std::string suffix = ".by";
+  for (const std::string &key : by) {
+    suffix += '-' + key;
+  }
+  const auto has_by = [&](const Parameters &parameters) {
+    return std::ranges::all_of(by, [&](const std::string &key) {
+      return std::ranges::find(parameters, key,
+                               &Parameters::value_type::first) !=
+             parameters.end();
+    });
+  };
+  // The other parameters, and whether their values differ.
+  std::map<std::string, std::pair<std::string, bool>> others;
+  for (const auto &[parameters, runs] : configurations) {
+    if (!has_by(parameters)) {
+      continue;
+    }
+    for (const auto &[key, value] : parameters) {
+      if (std::ranges::find(by, key) != by.end()) {
+        continue;
+      }
+      const auto [other, added] = others.try_emplace(key, value, false);
+      other->second.second |= !added && other->second.first != value;
+    }
+  }
+  const bool any_differ = std::ranges::any_of(
+      others, [](const auto &other) { return other.second.second; });
+
+  // Values of `by` and summary of each configuration, by file name.
+  std::map<std::string, std::vector<std::pair<Parameters, Summary>>> files;
+  for (const auto &[parameters, runs] : configurations) {
+    std::string name;
+    Parameters by_values;
+    for (const auto &[key, value] : parameters) {
+      if (std::ranges::find(by, key) != by.end()) {
+        by_values.emplace_back(key, value);
+      } else if (!any_differ || others[key].second) {
+        name += (name.empty() ? "" : "-") + value;
+      }
+    }
+    if (by_values.size() != by.size()) {
+      continue;
+    }
+    std::ranges::sort(by_values, [&](const auto &left, const auto &right) {
+      return std::ranges::find(by, left.first) <
+             std::ranges::find(by, right.first);
+    });
+    files[name].emplace_back(std::move(by_values),
+                             summarize(runs, resamples));
+  }
+  for (auto &[name, lines] : files) {
+    std::ranges::sort(lines, [](const auto &left, const auto &right) {
+      return less_parameters(left.first, right.first);
+    });
+    std::ofstream out(name + suffix);
+    for (std::size_t i = 0; i < lines.size(); ++i) {
+      const auto &[by_values, s] = lines[i];
+      if (i && by.size() > 1 &&
+          by_values.front() != lines[i - 1].first.front()) {
+        out << '\n';
+      }
+      for (const auto &[key, value] : by_values) {
+        out << value << ' ';
+      }
+      out << s.mean << ' ' << s.sd << ' ' << s.median << ' ' << s.p5 << ' '
+          << s.p95 << ' ' << s.ci_low << ' ' << s.ci_high << '\n';
+    }
+  }
+}
+
+// Print, for the configurations that have the parameter `per` and are alike
+// but for it, the mean and what each unit of `per` adds to the mean compared
+// to the configuration with the lowest nonzero numeric value of `per`, or zero
+// if that is the only value, with the bootstrap 95% confidence interval of
+// that.
+void print_per(const Configurations &configurations, const std::string &per,
+               int resamples) {
+  // Value of `per` and runs of each configuration, by the other parameters.
+  std::map<Parameters, std::vector<std::pair<Parameters, const Runs *>>,
+           LessParameters>
+      groups;
+  for (const auto &[parameters, runs] : configurations) {
+    Parameters others, unit;
+    for (const auto &[key, value] : parameters) {
+      (key == per && parse_double(value) ? unit : others)
+          .emplace_back(key, value);
+    }
+    if (!unit.empty()) {
+      groups[others].emplace_back(std::move(unit), &runs);
+    }
+  }
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << std::setw(10) << per << std::setw(10) << "mean"
+            << std::setw(10) << "per unit" << std::setw(21)
+            << "95% CI per unit" << "  configuration\n";
+  for (auto &[others, values] : groups) {
+    std::ranges::sort(values, less_parameters,
+                      &std::pair<Parameters, const Runs *>::first);
+    const auto baseline = std::ranges::find_if(values, [](const auto &value) {
+      return *parse_double(value.first[0].second) != 0;
+    });
+    const auto &[lowest_value, base_runs] =
+        baseline == values.end() ? values.front() : *baseline;
+    const double lowest = *parse_double(lowest_value[0].second);
+    const Runs &base = *base_runs;
+    for (const auto &[value, runs] : values) {
+      const double unit = *parse_double(value[0].second);
+      const Summary s = summarize(*runs, resamples);
+      std::cout << std::setw(10) << value[0].second << std::setw(10) << s.mean;
+      if (unit <= lowest) {
+        std::cout << std::setw(31) << "";
+      } else {
+        std::mt19937_64 random;
+        std::vector<double> added;
+        for (int i = 0; i < resamples; ++i) {
+          const double before = resampled_mean(base, random);
+          added.push_back((resampled_mean(*runs, random) - before) /
+                          (unit - lowest));
+        }
+        std::sort(added.begin(), added.end());
+        std::cout << std::setw(10)
+                  << (s.mean - summarize(base, 1).mean) / (unit - lowest)
+                  << std::setw(10) << quantile(added, 0.025) << " .."
+                  << std::setw(8) << quantile(added, 0.975);
+      }
+      std::cout << "  " << label(others) << '\n';
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<fs::path> inputs, baselines;
+  std::vector<std::pair<std::string, std::vector<std::string>>> filters;
+  double tolerance = 0.01;
+  int resamples = 2000;
+  std::string field = "sent_MB_per_second";
+  std::vector<std::string> by;
+  std::string per;
+  bool lower_is_better = false;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    const auto value = [&]() {
+      return std::string(arg.substr(arg.find('=') + 1));
+    };
+    if (arg == "-h" || arg == "--help") {
+      usage(std::cout, argv[0]);
+      return 0;
+    } else if (arg.starts_with("--baseline=")) {
+      baselines.push_back(value());
+    } else if (arg.starts_with("--tolerance=")) {
+      tolerance = std::stod(value()) / 100;
+    } else if (arg.starts_with("--resamples=")) {
+      resamples = std::max(1, std::stoi(value()));
+    } else if (arg == "--by-pages") {
+      by = {"pages"};
+    } else if (arg.starts_with("--by=")) {
+      by.clear();
+      std::istringstream list(value());
+      for (std::string key; std::getline(list, key, ',');) {
+        by.push_back(key);
+      }
+    } else if (arg.starts_with("--per=")) {
+      per = value();
+    } else if (arg.starts_with("--field=")) {
+      field = value();
+    } else if (arg == "--lower-is-better") {
+      lower_is_better = true;
+    } else if (arg.starts_with("--where=")) {
+      const std::string filter = value();
+      const auto equals = filter.find('=');
+      if (equals == std::string::npos) {
+        usage(std::cerr, argv[0]);
+        return 2;
+      }
+      std::vector<std::string> values;
+      std::istringstream list(filter.substr(equals + 1));
+      for (std::string item; std::getline(list, item, ',');) {
+        values.push_back(item);
+      }
+      filters.emplace_back(filter.substr(0, equals), std::move(values));
+    } else if (arg.starts_with("-")) {
+      usage(std::cerr, argv[0]);
+      return 2;
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+  if (inputs.empty()) {
+    usage(std::cerr, argv[0]);
+    return 2;
+  }
+
+  Configurations configurations, baseline;
+  for (const auto &path : inputs) {
+    if (!read_input(path, field, configurations)) {
+      return 1;
+    }
+  }
+  for (const auto &path : baselines) {
+    if (!read_input(path, field, baseline)) {
+      return 1;
+    }
+  }
+  std::erase_if(configurations, [&](const auto &entry) {
+    return std::ranges::any_of(filters, [&](const auto &filter) {
+      const auto &[key, values] = filter;
+      const auto parameter = std::ranges::find(
+          entry.first, key, &Parameters::value_type::first);
+      return parameter == entry.first.end() ||
+             std::ranges::find(values, parameter->second) == values.end();
+    });
+  });
+
+  if (!by.empty()) {
+    write_by(configurations, by, resamples);
+    return 0;
+  }
+  if (!per.empty()) {
+    print_per(configurations, per, resamples);
+    return 0;
+  }
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << std::setw(6) << "runs" << std::setw(8) << "samples"
+            << std::setw(10) << "mean" << std::setw(9) << "sd"
+            << std::setw(10) << "median" << std::setw(10) << "p5"
+            << std::setw(10) << "p95" << std::setw(21) << "95% CI of mean";
+  if (!baseline.empty()) {
+    std::cout << std::setw(10) << "baseline" << std::setw(20)
+              << "95% CI of change";
+  }
+  std::cout << "  configuration (" << field << ")\n";
+
+  int regressions = 0;
+  for (const auto &[parameters, runs] : configurations) {
+    const Summary s = summarize(runs, resamples);
+    std::cout << std::setw(6) << s.runs << std::setw(8) << s.samples
+              << std::setw(10) << s.mean << std::setw(9) << s.sd
+              << std::setw(10) << s.median << std::setw(10) << s.p5
+              << std::setw(10) << s.p95 << std::setw(10) << s.ci_low << " .."
+              << std::setw(8) << s.ci_high;
+    const char *verdict = "";
+    if (!baseline.empty()) {
+      const auto old = baseline.find(parameters);
+      if (old == baseline.end() || summarize(old->second, 1).samples == 0 ||
+          s.samples == 0) {
+        std::cout << std::setw(10) << "-" << std::setw(20) << "";
+      } else {
+        const auto [low, high] = change_interval(old->second, runs, resamples);
+        std::cout << std::setw(10) << summarize(old->second, 1).mean
+                  << std::setw(8) << low * 100 << "% .." << std::setw(7)
+                  << high * 100 << '%';
+        const bool worse =
+            lower_is_better ? low > tolerance : high < -tolerance;
+        const bool better =
+            lower_is_better ? high < -tolerance : low > tolerance;
+        if (worse) {
+          verdict = "  REGRESSION";
+          ++regressions;
+        } else if (better) {
+          verdict = "  improvement";
+        }
+      }
+    }
+    std::cout << "  " << label(parameters) << verdict << '\n';
+  }
+
+  if (regressions) {
+    std::cerr << regressions << " configuration(s) regressed by more than "
+              << tolerance * 100 << "%.\n";
+    return 1;
+  }
+}
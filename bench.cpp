@@ -0,0 +1,530 @@
+// Run `echo-server` once for each combination of the parameters declared in a
+// matrix file, and collect the structured logs of all runs into one JSONL
+// results file.
+//
+// A matrix file contains lines of the form
+//
+//     key = value...
+//
+// where blank lines and text following '#' are ignored. A numeric range can be
+// written as "first..last". The following keys are settings of the driver:
+//
+//     server       path to the echo-server binary (default: ./echo-server)
+//     results      path of the results file (default: results.jsonl)
+//     repetitions  number of times to run each combination (default: 1)
+//     warmup       seconds at the start of each run not logged (default: 5)
+//     duration     seconds logged per run after the warm-up (default: 60)
+//     timeout      seconds after which a run is killed (default: warmup +
+//                  duration + 30)
+//     cpus         CPU sets to which runs are confined, e.g. "0-3 4-7"; one run
+//                  executes in each set at a time (default: no confinement,
+//                  one run at a time)
+//
+// Every other key is a parameter of the matrix. The parameters "mode",
+// "family" and "pages" are passed to echo-server as its positional arguments,
+// and any other parameter "name" is passed as "--name=value". For example,
+// "ring = default sqpoll" runs every combination with each of two ring
+// profiles.
+//
+// Settings can also be given on the command line, after the matrix file, as
+// "key=value", overriding the file. Repetitions form the outermost loop, so
+// that slow drifts in the machine's state affect all combinations alike.
+//
+// Each run appends a "bench_run" record describing the run's parameters,
+// repetition, CPU set, status ("ok", "failed" or "timeout") and wall time to
+// the results file, followed by the records that echo-server logged, each
+// tagged with the "run_id" of its "bench_run" record.
+
+extern "C" {
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>  // mkdtemp
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}  // extern "C"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "json.h"
+
+namespace fs = std::filesystem;
+
+void usage(std::ostream &out, const char *argv0) {
+  out << "usage: " << argv0 << " <matrix-file> [key=value...]\n"
+      << "\nSee the comment at the top of bench.cpp for the format of "
+         "<matrix-file>.\n";
+}
+
+std::string_view trim(std::string_view text) {
+  const auto begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string_view::npos) {
+    return {};
+  }
+  const auto end = text.find_last_not_of(" \t\r");
+  return text.substr(begin, end - begin + 1);
+}
+
+std::optional<long> parse_long(std::string_view text) {
+  long value;
+  const auto [end, err] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  if (err != std::errc() || end != text.data() + text.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+// Return the whitespace-separated words of `text`, expanding each numeric
+// range "first..last" into its elements.
+std::vector<std::string> expand_values(std::string_view text) {
+  std::vector<std::string> values;
+  std::istringstream words{std::string(text)};
+  std::string word;
+  while (words >> word) {
+    const auto dots = word.find("..");
+    if (dots != std::string::npos) {
+      const auto first = parse_long(std::string_view(word).substr(0, dots));
+      const auto last = parse_long(std::string_view(word).substr(dots + 2));
+      if (first && last) {
+        for (long i = *first; i <= *last; ++i) {
+          values.push_back(std::to_string(i));
+        }
+        continue;
+      }
+    }
+    values.push_back(word);
+  }
+  return values;
+}
+
+// Parse the specified `cpus`, e.g. "0-3,6", into `set`. Return whether `cpus`
+// is well formed.
+bool parse_cpu_set(std::string_view cpus, cpu_set_t &set) {
+  CPU_ZERO(&set);
+  while (!cpus.empty()) {
+    const auto comma = cpus.find(',');
+    const std::string_view range = cpus.substr(0, comma);
+    const auto dash = range.find('-');
+    const auto first = parse_long(range.substr(0, dash));
+    const auto last = dash == std::string_view::npos
+                          ? first
+                          : parse_long(range.substr(dash + 1));
+    if (!first || !last || *first < 0 || *last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = *first; cpu <= *last; ++cpu) {
+      CPU_SET(cpu, &set);
+    }
+    cpus = comma == std::string_view::npos ? std::string_view()
+                                            : cpus.substr(comma + 1);
+  }
+  return true;
+}
+
+struct Settings {
+  std::string server = "./echo-server";
+  std::string results = "results.jsonl";
+  int repetitions = 1;
+  int warmup = 5;
+  int duration = 60;
+  std::optional<int> timeout;
+  // Empty means "no confinement."
+  std::vector<std::string> cpus;
+};
+
+struct Matrix {
+  Settings settings;
+  // Parameters in the order declared, each with its values.
+  std::vector<std::pair<std::string, std::vector<std::string>>> parameters;
+};
+
+// Apply the specified `key = value` line to `matrix`. Return whether the line
+// is valid.
+bool apply(Matrix &matrix, std::string_view key, std::string_view value) {
+  Settings &settings = matrix.settings;
+  const auto integer = [&](int &destination) {
+    const auto parsed = parse_long(value);
+    if (parsed) {
+      destination = *parsed;
+    }
+    return parsed.has_value();
+  };
+
+  if (key == "server") {
+    settings.server = value;
+  } else if (key == "results") {
+    settings.results = value;
+  } else if (key == "repetitions") {
+    return integer(settings.repetitions);
+  } else if (key == "warmup") {
+    return integer(settings.warmup);
+  } else if (key == "duration") {
+    return integer(settings.duration);
+  } else if (key == "timeout") {
+    int timeout;
+    if (!integer(timeout)) {
+      return false;
+    }
+    settings.timeout = timeout;
+  } else if (key == "cpus") {
+    settings.cpus = expand_values(value);
+    cpu_set_t set;
+    return std::all_of(settings.cpus.begin(), settings.cpus.end(),
+                       [&](const std::string &cpus) {
+                         return parse_cpu_set(cpus, set);
+                       });
+  } else {
+    std::vector<std::string> values = expand_values(value);
+    if (values.empty()) {
+      return false;
+    }
+    const auto found = std::find_if(
+        matrix.parameters.begin(), matrix.parameters.end(),
+        [&](const auto &parameter) { return parameter.first == key; });
+    if (found != matrix.parameters.end()) {
+      found->second = std::move(values);
+    } else {
+      matrix.parameters.emplace_back(key, std::move(values));
+    }
+  }
+  return true;
+}
+
+// Apply the line "key = value" or "key=value" to `matrix`, printing a
+// diagnostic mentioning `where` if the line is invalid. Return whether the
+// line is valid.
+bool apply_line(Matrix &matrix, std::string_view line, std::string_view where) {
+  line = trim(line.substr(0, line.find('#')));
+  if (line.empty()) {
+    return true;
+  }
+  const auto equals = line.find('=');
+  if (equals != std::string_view::npos &&
+      apply(matrix, trim(line.substr(0, equals)),
+            trim(line.substr(equals + 1)))) {
+    return true;
+  }
+  std::cerr << where << ": invalid line: " << line << '\n';
+  return false;
+}
+
+// One run of the server with particular parameter values.
+struct Run {
+  int id = 0;
+  int repetition = 0;
+  std::vector<std::pair<std::string, std::string>> parameters;
+};
+
+// A run that is in progress.
+struct Running {
+  Run run;
+  pid_t pid = -1;
+  std::size_t cpus = 0;  // index into `Settings::cpus`
+  fs::path dir;          // holds the log, stderr, and the server's TMPDIR
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point deadline;
+};
+
+// Fork and execute the server for the specified `running` run. Return the
+// child's pid, or `-errno` if an error occurs.
+pid_t launch(const Settings &settings, Running &running) {
+  std::vector<std::string> args = {settings.server};
+  for (const char *positional : {"mode", "family", "pages"}) {
+    for (const auto &[key, value] : running.run.parameters) {
+      if (key == positional) {
+        args.push_back(value);
+      }
+    }
+  }
+  for (const auto &[key, value] : running.run.parameters) {
+    if (key != "mode" && key != "family" && key != "pages") {
+      args.push_back("--" + key + "=" + value);
+    }
+  }
+  args.push_back("--format=jsonl");
+  args.push_back("--log=" + (running.dir / "log.jsonl").string());
+  args.push_back("--warmup=" + std::to_string(settings.warmup));
+  args.push_back("--duration=" + std::to_string(settings.duration));
+
+  const pid_t pid = fork();
+  if (pid != 0) {
+    return pid < 0 ? -errno : pid;
+  }
+
+  // child
+  // Put the server and its clients in their own process group, so that they
+  // can all be killed together.
+  setpgid(0, 0);
+  if (!settings.cpus.empty()) {
+    cpu_set_t set;
+    parse_cpu_set(settings.cpus[running.cpus], set);
+    if (sched_setaffinity(0, sizeof set, &set)) {
+      std::perror("sched_setaffinity");
+      _exit(126);
+    }
+  }
+  const fs::path tmp = running.dir / "tmp";
+  setenv("TMPDIR", tmp.c_str(), 1);
+  const int null = open("/dev/null", O_WRONLY);
+  const int err = open((running.dir / "stderr").c_str(),
+                       O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  dup2(null, STDOUT_FILENO);
+  dup2(err, STDERR_FILENO);
+
+  std::vector<char *> argv;
+  for (std::string &arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+  execv(argv[0], argv.data());
+  std::perror(argv[0]);
+  _exit(127);
+}
+
+// Return the last few lines of the specified `file`.
+std::string tail(const fs::path &file) {
+  std::ifstream in(file);
+  std::deque<std::string> lines;
+  for (std::string line; std::getline(in, line);) {
+    lines.push_back(std::move(line));
+    if (lines.size() > 5) {
+      lines.pop_front();
+    }
+  }
+  std::string result;
+  for (const std::string &line : lines) {
+    result += line;
+    result += '\n';
+  }
+  return result;
+}
+
+// Append the records of the specified finished run to `results`.
+void record(std::ostream &results, const Settings &settings,
+            const Running &running, std::string_view status, int exit_code) {
+  const auto wall = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - running.start);
+  results << "{\"type\":\"bench_run\",\"run_id\":" << running.run.id
+          << ",\"repetition\":" << running.run.repetition;
+  for (const auto &[key, value] : running.run.parameters) {
+    results << ',';
+    json_quote(results, key);
+    results << ':';
+    if (parse_long(value)) {
+      results << value;
+    } else {
+      json_quote(results, value);
+    }
+  }
+  results << ",\"cpus\":";
+  json_quote(results,
+             settings.cpus.empty() ? "all" : settings.cpus[running.cpus]);
+  results << ",\"status\":";
+  json_quote(results, status);
+  results << ",\"exit_code\":" << exit_code
+          << ",\"wall_seconds\":" << wall.count();
+  if (status != "ok") {
+    results << ",\"stderr\":";
+    json_quote(results, tail(running.dir / "stderr"));
+  }
+  results << "}\n";
+
+  std::ifstream log(running.dir / "log.jsonl");
+  const std::string tag = "{\"run_id\":" + std::to_string(running.run.id) + ',';
+  for (std::string line; std::getline(log, line);) {
+    if (line.starts_with('{')) {
+      results << tag << std::string_view(line).substr(1) << '\n';
+    }
+  }
+  results << std::flush;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage(std::cerr, argv[0]);
+    return 1;
+  }
+  if (std::string_view(argv[1]) == "-h" ||
+      std::string_view(argv[1]) == "--help") {
+    usage(std::cout, argv[0]);
+    return 0;
+  }
+
+  Matrix matrix;
+  std::ifstream file(argv[1]);
+  if (!file) {
+    std::cerr << "Unable to open " << argv[1] << '\n';
+    return 1;
+  }
+  int line_number = 0;
+  for (std::string line; std::getline(file, line);) {
+    ++line_number;
+    if (!apply_line(matrix, line,
+                    std::string(argv[1]) + ":" + std::to_string(line_number))) {
+      return 2;
+    }
+  }
+  for (int i = 2; i < argc; ++i) {
+    if (!apply_line(matrix, argv[i], "command line")) {
+      return 2;
+    }
+  }
+  for (const char *required : {"mode", "family", "pages"}) {
+    if (std::none_of(matrix.parameters.begin(), matrix.parameters.end(),
+                     [&](const auto &parameter) {
+                       return parameter.first == required;
+                     })) {
+      std::cerr << "The matrix must declare \"" << required << "\".\n";
+      return 2;
+    }
+  }
+  const Settings &settings = matrix.settings;
+  const auto timeout = std::chrono::seconds(
+      settings.timeout.value_or(settings.warmup + settings.duration + 30));
+
+  // Enumerate the runs, repetitions outermost and the last declared parameter
+  // varying fastest.
+  std::deque<Run> pending;
+  int next_id = 0;
+  for (int repetition = 0; repetition < settings.repetitions; ++repetition) {
+    std::vector<std::size_t> indices(matrix.parameters.size());
+    for (;;) {
+      Run &run = pending.emplace_back();
+      run.id = next_id++;
+      run.repetition = repetition;
+      for (std::size_t i = 0; i < indices.size(); ++i) {
+        run.parameters.emplace_back(matrix.parameters[i].first,
+                                    matrix.parameters[i].second[indices[i]]);
+      }
+      std::size_t i = indices.size();
+      while (i > 0 &&
+             ++indices[i - 1] == matrix.parameters[i - 1].second.size()) {
+        indices[--i] = 0;
+      }
+      if (i == 0) {
+        break;
+      }
+    }
+  }
+
+  std::ofstream results(settings.results);
+  if (!results) {
+    std::cerr << "Unable to open " << settings.results << '\n';
+    return 1;
+  }
+  std::string scratch_template =
+      (fs::temp_directory_path() / "bench-XXXXXX").string();
+  if (!mkdtemp(scratch_template.data())) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  const fs::path scratch = scratch_template;
+
+  const std::size_t slots = std::max<std::size_t>(1, settings.cpus.size());
+  std::vector<std::optional<Running>> running(slots);
+  const std::size_t total = pending.size();
+  std::size_t finished = 0, failures = 0;
+
+  while (!pending.empty() ||
+         std::any_of(running.begin(), running.end(),
+                     [](const auto &slot) { return slot.has_value(); })) {
+    for (std::size_t slot = 0; slot < slots; ++slot) {
+      if (running[slot] || pending.empty()) {
+        continue;
+      }
+      Running &started = running[slot].emplace();
+      started.run = std::move(pending.front());
+      pending.pop_front();
+      started.cpus = slot;
+      started.dir = scratch / std::to_string(started.run.id);
+      fs::create_directories(started.dir / "tmp");
+      started.start = std::chrono::steady_clock::now();
+      started.deadline = started.start + timeout;
+      started.pid = launch(settings, started);
+      if (started.pid < 0) {
+        std::cerr << "Unable to fork: " << std::strerror(-started.pid) << '\n';
+        return 1;
+      }
+      std::cerr << "run " << started.run.id + 1 << '/' << total << ':';
+      for (const auto &[key, value] : started.run.parameters) {
+        std::cerr << ' ' << key << '=' << value;
+      }
+      std::cerr << " repetition=" << started.run.repetition << '\n';
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    for (std::optional<Running> &slot : running) {
+      if (!slot) {
+        continue;
+      }
+      int status = 0;
+      pid_t rc;
+      do {
+        rc = waitpid(slot->pid, &status, WNOHANG);
+      } while (rc < 0 && errno == EINTR);
+      // E.g. ECHILD, if the run was reaped elsewhere: its status is unknown.
+      const int wait_error = rc < 0 ? errno : 0;
+      if (wait_error) {
+        std::cerr << "run " << slot->run.id + 1
+                  << ": unable to wait for it: " << std::strerror(wait_error)
+                  << '\n';
+      }
+      const bool timed_out =
+          rc == 0 && std::chrono::steady_clock::now() >= slot->deadline;
+      if (rc == 0 && !timed_out) {
+        continue;
+      }
+      if (timed_out) {
+        kill(-slot->pid, SIGKILL);
+        while (waitpid(slot->pid, &status, 0) < 0 && errno == EINTR) {
+        }
+      }
+      // Kill whatever remains of the process group, e.g. clients that
+      // outlived the server.
+      kill(-slot->pid, SIGKILL);
+
+      const int exit_code = wait_error         ? -1
+                            : WIFEXITED(status) ? WEXITSTATUS(status)
+                                                : 128 + WTERMSIG(status);
+      const char *const outcome = timed_out       ? "timeout"
+                                  : exit_code == 0 ? "ok"
+                                                   : "failed";
+      if (std::string_view(outcome) != "ok") {
+        ++failures;
+        std::cerr << "run " << slot->run.id + 1 << ": " << outcome
+                  << " (exit code " << exit_code << ")\n";
+      }
+      record(results, settings, *slot, outcome, exit_code);
+      std::error_code ignored;
+      fs::remove_all(slot->dir, ignored);
+      slot.reset();
+      ++finished;
+    }
+  }
+
+  std::error_code ignored;
+  fs::remove_all(scratch, ignored);
+  std::cerr << finished << " runs finished, " << failures << " failed. "
+            << "Results are in " << settings.results << ".\n";
+  return failures ? 1 : 0;
+}
@@ -7,7 +7,15 @@ set xtics 4
 
 # set terminal svg size 1024,768 fixed enhanced font 'Arial,12' butt dashlength 1.0
 
+# The files are written by ./by-pages from the results of ./collect.sh. Logs
+# collected with echo-server-simpler, such as those in the tree, have "splice"
+# instead of "splicetee", which spliced the echo only, without teeing it to an
+# observer. Plot them with
+#
+#     gnuplot -e "splice='splice'" by-pages.plot
+if (!exists("splice")) splice = 'splicetee'
+
 plot 'recvsend-tcp.by-pages' with errorbars title 'recvsend-tcp', \
      'recvsend-unix.by-pages' using ($1+0.1):2:3 with errorbars title 'recvsend-unix', \
-     'splice-tcp.by-pages' using ($1+0.2):2:3 with errorbars title 'splice-tcp', \
-     'splice-unix.by-pages' using ($1+0.3):2:3 with errorbars title 'splice-unix'
+     splice.'-tcp.by-pages' using ($1+0.2):2:3 with errorbars title splice.'-tcp', \
+     splice.'-unix.by-pages' using ($1+0.3):2:3 with errorbars title splice.'-unix'
@@ -1,18 +1,13 @@
 #!/bin/sh
 
-set -x
-
-lines=240
-sed_script="${lines}q"
-
-for pages in $(seq 64); do
-  for family in tcp unix; do
-    for io in splice recvsend; do
-      ./echo-server-simpler "$io" "$family" "$pages" | sed "$sed_script"
-      rm -rf /tmp/echo-server-*
-      mv log "$io-$family-$pages.log"
-    done
-  done
-done
+# Run the transfer-size sweep declared in sweep.matrix. Any arguments are
+# passed on to the benchmark driver, e.g. "./collect.sh repetitions=3".
+#
+# This used to run echo-server-simpler, whose "splice" mode spliced the echo
+# only. echo-server has no such mode: its "splicetee" also tees everything to
+# an observer, so its results are not comparable with the "splice-*" logs of
+# before. by-pages.plot plots "splicetee" unless told otherwise (see there).
 
+set -x
 
+exec ./bench sweep.matrix "$@"
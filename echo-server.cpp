@@ -1,10 +1,21 @@
 extern "C" {
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>  // newer than glibc's tcp_info
 #include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <unistd.h>
 }  // extern "C"
@@ -12,23 +23,48 @@ extern "C" {
 #include <liburing.h>
 #include <stdlib.h>  // mkdtemp
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <bit>
 #include <cerrno>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <latch>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
 #include <ostream>
+#include <random>
+#include <ranges>
+#include <span>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include <variant>
 #include <vector>
 
+#include "json.h"
+#include "trace.h"
+
 #define POSIX_REQUIRE(EXPR)                                      \
   if (-1 == (EXPR)) {                                            \
     const int err = errno;                                       \
@@ -147,317 +183,3396 @@ class Unix : public Net {
   }
 };
 
-struct alignas(8) IOEntryContext {
-  enum Operation { TEE, SPLICE, SEND, RECV };
-  std::int64_t bytes_desired : 33;
-  Operation op : 3;
-  int from_fd : 14;
-  int to_fd : 14;
-};
+// A byte stream from one process to another through shared memory instead of
+// a socket: a single-producer, single-consumer ring buffer in a memfd mapping
+// that the processes share by `fork()`, with an eventfd to wake a reader that
+// waits for data and another to wake a writer that waits for room.
+class ShmRing {
+  struct Header {
+    // Bytes ever written and read, each advanced by one side only.
+    alignas(64) std::atomic<std::uint64_t> head;
+    alignas(64) std::atomic<std::uint64_t> tail;
+    // Whether the reader waits on `readable_fd`, and the writer on
+    // `writable_fd`.
+    alignas(64) std::atomic<bool> reader_waiting;
+    alignas(64) std::atomic<bool> writer_waiting;
+  };
 
-static_assert(sizeof(IOEntryContext) == 8);
+  Header *header = nullptr;
+  char *data = nullptr;
+  std::size_t capacity = 0;
+  int memfd = -1;
+  int readable_fd = -1;
+  int writable_fd = -1;
 
-void io_uring_prep(io_uring_sqe *sqe, IOEntryContext io_ctx, int flags = 0,
-                   char *buffer = nullptr) {
-  switch (io_ctx.op) {
-    case IOEntryContext::TEE:
-      io_uring_prep_tee(sqe, io_ctx.from_fd, io_ctx.to_fd, io_ctx.bytes_desired,
-                        0);
-      break;
-    case IOEntryContext::SPLICE:
-      io_uring_prep_splice(sqe, io_ctx.from_fd, -1, io_ctx.to_fd, -1,
-                           io_ctx.bytes_desired, flags);
-      break;
-    case IOEntryContext::SEND:
-      io_uring_prep_send(sqe, io_ctx.to_fd, buffer, io_ctx.bytes_desired,
-                         flags);
-      break;
-    case IOEntryContext::RECV:
-      io_uring_prep_recv(sqe, io_ctx.from_fd, buffer, io_ctx.bytes_desired,
-                         flags);
-      break;
-    default:
-      std::unreachable();
+  std::size_t mapping_size() const { return getpagesize() + capacity; }
+
+  // Signal the eventfd `fd` if the other side set `waiting` to wait on it.
+  // The fence orders the caller's store of `head` or `tail` before the load
+  // of `waiting`, as `wait_readable` and `wait_writable` order theirs, so
+  // that either the waiter sees the update or this sees the waiter.
+  static void wake(std::atomic<bool> &waiting, int fd) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed) && waiting.exchange(false)) {
+      eventfd_write(fd, 1);
+    }
   }
-  io_uring_sqe_set_data64(sqe, std::bit_cast<std::uint64_t>(io_ctx));
-}
 
-// Connect and `recv()` continuously, discarding all data.
-int client_sink(int bufsize, Net &net, int server_sock) {
-  int sock;
-  URING_REQUIRE(sock = net.client_socket(server_sock));
+ public:
+  ShmRing() = default;
+  ShmRing(const ShmRing &) = delete;
+  ShmRing &operator=(const ShmRing &) = delete;
 
-  std::vector<char> buffer(bufsize);
-  for (;;) {
-    int rc;
-    POSIX_REQUIRE(rc = recv(sock, buffer.data(), buffer.size(), MSG_TRUNC));
-    if (rc == 0) {
-      return 0;
+  ~ShmRing() {
+    if (header) {
+      munmap(header, mapping_size());
+    }
+    for (const int fd : {memfd, readable_fd, writable_fd}) {
+      if (fd >= 0) {
+        close(fd);
+      }
     }
   }
-}
 
-// Connect and concurrently `send()` zeros and `recv()`, discarding all
-// received data.
-int client_source_and_sink(int bufsize, Net &net, int server_sock) {
-  io_uring ring;
-  URING_REQUIRE(io_uring_queue_init(8, &ring, 0));
+  // Create the ring with room for `capacity` bytes, a power of two. Return
+  // zero on success or `-errno` if an error occurs.
+  int create(std::size_t capacity) {
+    this->capacity = capacity;
+    POSIX_REQUIRE(memfd = memfd_create("echo-server-ring", MFD_CLOEXEC));
+    POSIX_REQUIRE(ftruncate(memfd, mapping_size()));
+    void *const memory =
+        mmap(nullptr, mapping_size(), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, memfd, 0);
+    if (memory == MAP_FAILED) {
+      return -errno;
+    }
+    header = new (memory) Header();
+    data = static_cast<char *>(memory) + getpagesize();
+    POSIX_REQUIRE(readable_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    POSIX_REQUIRE(writable_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    return 0;
+  }
 
-  int sock;
-  URING_REQUIRE(sock = net.client_socket(server_sock));
+  // Return the room that the writer can fill next without wrapping around.
+  std::span<char> writable() const {
+    const std::uint64_t head = header->head.load(std::memory_order_relaxed);
+    const std::uint64_t tail = header->tail.load(std::memory_order_acquire);
+    const std::size_t at = head & (capacity - 1);
+    return {data + at, std::min(capacity - (head - tail), capacity - at)};
+  }
 
-  io_uring_sqe *sqe;
-  io_uring_cqe *cqe;
-  IOEntryContext io_ctx = {};
-  std::vector<char> buffer(bufsize);
-  std::vector<char> payload(bufsize);
+  // Pass the next `bytes` written to the reader.
+  void commit(std::size_t bytes) {
+    header->head.store(header->head.load(std::memory_order_relaxed) + bytes,
+                       std::memory_order_release);
+    wake(header->reader_waiting, readable_fd);
+  }
 
-  const auto prep_send = [&]() {
-    sqe = io_uring_get_sqe(&ring);
-    if (!sqe) {
-      std::cerr << "Panic on line " << __LINE__ << '\n' << std::flush;
-      std::abort();
-    }
-    io_ctx.op = IOEntryContext::SEND;
-    io_ctx.to_fd = sock;
-    io_ctx.bytes_desired = payload.size();
-    io_uring_prep(sqe, io_ctx, 0, payload.data());
-  };
+  // Return the data that the reader can take next without wrapping around.
+  std::span<const char> readable() const {
+    const std::uint64_t head = header->head.load(std::memory_order_acquire);
+    const std::uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    const std::size_t at = tail & (capacity - 1);
+    return {data + at, std::min<std::size_t>(head - tail, capacity - at)};
+  }
 
-  const auto prep_recv = [&]() {
-    sqe = io_uring_get_sqe(&ring);
-    if (!sqe) {
-      std::cerr << "Panic on line " << __LINE__ << '\n' << std::flush;
-      std::abort();
+  // Return the next `bytes` read to the writer.
+  void consume(std::size_t bytes) {
+    header->tail.store(header->tail.load(std::memory_order_relaxed) + bytes,
+                       std::memory_order_release);
+    wake(header->writer_waiting, writable_fd);
+  }
+
+  // Return the eventfd that the writer will signal once there is data, or
+  // -1 if there is data already.
+  int wait_readable() {
+    header->reader_waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!readable().empty()) {
+      header->reader_waiting.store(false, std::memory_order_relaxed);
+      return -1;
     }
-    io_ctx.op = IOEntryContext::RECV;
-    io_ctx.from_fd = sock;
-    io_ctx.bytes_desired = buffer.size();
-    io_uring_prep(sqe, io_ctx, MSG_TRUNC, buffer.data());
-  };
+    return readable_fd;
+  }
 
-  prep_send();
-  prep_recv();
-  io_uring_submit(&ring);
+  // Return the eventfd that the reader will signal once there is room, or
+  // -1 if there is room already.
+  int wait_writable() {
+    header->writer_waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!writable().empty()) {
+      header->writer_waiting.store(false, std::memory_order_relaxed);
+      return -1;
+    }
+    return writable_fd;
+  }
+};
 
-  for (;;) {
-    URING_REQUIRE(io_uring_wait_cqe(&ring, &cqe));
-    URING_REQUIRE(cqe->res);
-    const int result = cqe->res;
-    io_ctx = std::bit_cast<IOEntryContext>(io_uring_cqe_get_data64(cqe));
-    io_uring_cqe_seen(&ring, cqe);
-    switch (io_ctx.op) {
-      case IOEntryContext::RECV:
-        if (result == 0) {
-          // Server hung up.
-          return 0;
-        }
-        prep_recv();
-        io_uring_submit(&ring);
-        break;
-      case IOEntryContext::SEND:
-        prep_send();
-        io_uring_submit(&ring);
-        break;
-      default:
-        std::abort();
+// Wait for up to `timeout` milliseconds until one of the specified eventfds
+// (see `ShmRing`) is signalled, returning at once if one of them is -1, or
+// until the peer of the socket `sock`, on which nothing is sent, hangs up.
+// Return 1 if it did, zero if not, or `-errno` if an error occurs.
+int wait_shm(std::span<const int> eventfds, int sock, int timeout) {
+  if (std::ranges::find(eventfds, -1) != eventfds.end()) {
+    return 0;
+  }
+  std::vector<pollfd> fds;
+  for (const int fd : eventfds) {
+    fds.push_back({.fd = fd, .events = POLLIN, .revents = 0});
+  }
+  fds.push_back({.fd = sock, .events = POLLIN, .revents = 0});
+  if (poll(fds.data(), fds.size(), timeout) == -1 && errno != EINTR) {
+    return -errno;
+  }
+  for (const pollfd &fd : fds) {
+    if (fd.fd != sock && fd.revents) {
+      eventfd_t count;
+      eventfd_read(fd.fd, &count);
     }
   }
+  return fds.back().revents != 0;
 }
 
-struct RawMetrics {
-  std::uint64_t bytes_sent = 0;
-  std::uint64_t short_reads = 0;
-  std::uint64_t short_writes_echo = 0;
-  std::uint64_t short_writes_observer = 0;
-  std::uint64_t short_writes_pipe = 0;
-  std::chrono::steady_clock::duration cpu_user =
-      std::chrono::steady_clock::duration();
-  std::chrono::steady_clock::duration cpu_system =
-      std::chrono::steady_clock::duration();
-  std::uint64_t page_faults_minor = 0;
-  std::uint64_t page_faults_major = 0;
-  std::uint64_t yields = 0;
-  std::uint64_t preempts = 0;
-};
-
-struct Snapshot : public RawMetrics {
-  std::chrono::steady_clock::time_point when;
-};
+// Return the `Net` of the specified address `family`, "tcp" or "unix", or
+// return null if there is no such family.
+std::unique_ptr<Net> make_net(std::string_view family) {
+  if (family == "tcp") {
+    return std::make_unique<TCP>();
+  }
+  if (family == "unix") {
+    return std::make_unique<Unix>();
+  }
+  return nullptr;
+}
 
-struct Metrics : public RawMetrics {
-  Snapshot snapshot;
+// What an operation submitted to a ring was asked to do. The context of each
+// operation in flight is kept in the submitting thread's `OpTable`, and the
+// SQE and CQE carry only its address there.
+struct IOEntryContext {
+  // `METRICS` is used by `MetricsServer`, which interprets `step` and
+  // `connection` as it sees fit. `TIMEOUT` is an absolute `CLOCK_MONOTONIC`
+  // timeout. `ACCEPT` is a multishot accept on `from_fd`, and `CLOSE` closes
+  // `from_fd`. `MESSAGE` posts a completion with the result `from_fd` to the
+  // ring `to_fd`, whose owner sees a `MESSAGE` with the same `step` and no
+  // file descriptors (see `OpTable::message_data`). `RECVMSG` receives on
+  // `from_fd` into the `msghdr` given with it, and `CONNECT` connects `to_fd`
+  // to the address given with it, of `bytes_desired` bytes.
+  enum Operation : std::uint8_t {
+    TEE,
+    SPLICE,
+    SEND,
+    RECV,
+    METRICS,
+    TIMEOUT,
+    ACCEPT,
+    CLOSE,
+    MESSAGE,
+    RECVMSG,
+    CONNECT,
+  };
+  std::int64_t bytes_desired = 0;
+  Operation op = TEE;
+  // What the operation is for, in loops with several kinds of the same
+  // operation, e.g. a `ConnectionStep`.
+  std::uint8_t step = 0;
+  int from_fd = -1;
+  int to_fd = -1;
+  // The index of the connection on whose behalf the operation was submitted,
+  // and that connection's generation at the time, which its owner compares
+  // with the connection's current generation to recognize completions that
+  // concern a previous use of the index.
+  std::uint32_t connection = 0;
+  std::uint32_t generation = 0;
 };
 
-int get_resource_usage(RawMetrics &raw) {
-  rusage usage = {};
-  POSIX_REQUIRE(getrusage(RUSAGE_SELF, &usage));
-
-  using namespace std::chrono;
-  raw.cpu_user =
-      seconds(usage.ru_utime.tv_sec) + microseconds(usage.ru_utime.tv_usec);
-  raw.cpu_system =
-      seconds(usage.ru_stime.tv_sec) + microseconds(usage.ru_stime.tv_usec);
-  raw.page_faults_minor = usage.ru_minflt;
-  raw.page_faults_major = usage.ru_majflt;
-  raw.yields = usage.ru_nvcsw;
-  raw.preempts = usage.ru_nivcsw;
+static_assert(std::size(trace_operation_names) ==
+              IOEntryContext::CONNECT + 1);
 
-  return 0;
-}
+// The contexts of the operations in flight on the rings of one thread,
+// addressed by the `user_data` of their SQEs and CQEs: the index of a slot in
+// the low 32 bits and the slot's generation in the high 32 bits. Slots live in
+// slabs that never move, one cache line each, and a slot's generation changes
+// whenever it is freed, so that a completion whose slot has been freed, e.g.
+// because its operation was abandoned, is recognized as stale instead of being
+// taken for the operation that uses the slot now.
+class OpTable {
+  static constexpr std::uint32_t slab_slots = 1024;
+  static constexpr std::uint32_t none = UINT32_MAX;
 
-/* man(7) documentation relevant to the above:
+  struct alignas(64) Slot {
+    IOEntryContext io_ctx;
+    std::uint32_t generation = 0;
+    // The next free slot, if this one is free.
+    std::uint32_t next_free = none;
+    bool used = false;
+  };
 
-       ru_utime
-              This is the total amount of time spent executing in user
-              mode, expressed in a timeval structure (seconds plus
-              microseconds).
+  std::vector<std::unique_ptr<Slot[]>> slabs;
+  std::uint32_t first_free = none;
+  std::size_t used = 0;
 
-       ru_stime
-              This is the total amount of time spent executing in kernel
-              mode, expressed in a timeval structure (seconds plus
-              microseconds).
+  Slot &slot(std::uint32_t index) const {
+    return slabs[index / slab_slots][index % slab_slots];
+  }
 
-       ru_minflt
-              The number of page faults serviced without any I/O
-              activity; here I/O activity is avoided by “reclaiming” a
-              page frame from the list of pages awaiting reallocation.
+  // Return the slot to which `user_data` refers if it is in use, or null.
+  Slot *find_slot(std::uint64_t user_data) const {
+    const std::uint32_t index = user_data;
+    if (index / slab_slots >= slabs.size()) {
+      return nullptr;
+    }
+    Slot &found = slot(index);
+    if (!found.used || found.generation != user_data >> 32) {
+      return nullptr;
+    }
+    return &found;
+  }
 
-       ru_majflt
-              The number of page faults serviced that required I/O
-              activity.
+ public:
+  // Store `io_ctx` in a free slot, and return the `user_data` that refers to
+  // it.
+  std::uint64_t insert(const IOEntryContext &io_ctx) {
+    if (first_free == none) {
+      const std::uint32_t begin = slabs.size() * slab_slots;
+      slabs.push_back(std::make_unique<Slot[]>(slab_slots));
+      for (std::uint32_t i = slab_slots; i-- > 0;) {
+        slot(begin + i).next_free = first_free;
+        first_free = begin + i;
+      }
+    }
+    const std::uint32_t index = first_free;
+    Slot &free = slot(index);
+    first_free = free.next_free;
+    free.io_ctx = io_ctx;
+    free.used = true;
+    ++used;
+    return std::uint64_t(free.generation) << 32 | index;
+  }
 
-       ru_nvcsw (since Linux 2.6)
-              The number of times a context switch resulted due to a
-              process voluntarily giving up the processor before its time
-              slice was completed (usually to await availability of a
-              resource).
+  // Return the `user_data` of the completion that a `MESSAGE` operation with
+  // the specified `step` posts to the ring of another thread. It refers to no
+  // slot of that thread's table.
+  static std::uint64_t message_data(std::uint8_t step) {
+    return std::uint64_t(step) << 32 | none;
+  }
 
-       ru_nivcsw (since Linux 2.6)
-              The number of times a context switch resulted due to a
-              higher priority process becoming runnable or because the
-              current process exceeded its time slice.
-*/
+  // Return the context to which `user_data` refers, or nothing if the slot has
+  // been freed since, i.e. if the completion is stale. For a message from
+  // another thread, return a `MESSAGE` context with the step of the message.
+  std::optional<IOEntryContext> find(std::uint64_t user_data) const {
+    if (std::uint32_t(user_data) == none) {
+      return IOEntryContext{.op = IOEntryContext::MESSAGE,
+                            .step = std::uint8_t(user_data >> 32)};
+    }
+    const Slot *const found = find_slot(user_data);
+    if (!found) {
+      return std::nullopt;
+    }
+    return found->io_ctx;
+  }
 
-std::string log_snapshot_diff(std::chrono::steady_clock::time_point start,
-                              std::chrono::steady_clock::time_point now,
-                              const Metrics &metrics) {
-  using namespace std::chrono;
+  // Return the context to which `user_data` refers and free its slot, or
+  // return nothing if the completion is stale.
+  std::optional<IOEntryContext> take(std::uint64_t user_data) {
+    if (std::uint32_t(user_data) == none) {
+      return find(user_data);
+    }
+    Slot *const found = find_slot(user_data);
+    if (!found) {
+      return std::nullopt;
+    }
+    found->used = false;
+    ++found->generation;
+    found->next_free = first_free;
+    first_free = std::uint32_t(user_data);
+    --used;
+    return found->io_ctx;
+  }
 
-  const auto diff = [&](const auto &mem_ptr) {
-    return (metrics.*mem_ptr - metrics.snapshot.*mem_ptr);
-  };
-  const auto scaled_diff = [&](const auto &mem_ptr) {
-    return diff(mem_ptr) * seconds(1) / (now - metrics.snapshot.when);
-  };
+  // Return the number of operations in flight.
+  std::size_t size() const { return used; }
+};
 
-  std::ostringstream sstream;
-  sstream << (now - start) / milliseconds(1) << " milliseconds\t"
-          << scaled_diff(&RawMetrics::bytes_sent) / 1'000'000 << " MB/s\t"
-          << scaled_diff(&RawMetrics::short_reads) << " short_reads/s\t"
-          << scaled_diff(&RawMetrics::short_writes_echo)
-          << " short_writes_echo/s\t"
-          << scaled_diff(&RawMetrics::short_writes_observer)
-          << " short_writes_observer/s\t"
-          << scaled_diff(&RawMetrics::short_writes_pipe)
-          << " short_writes_pipe/s\t"
-          // Note: NOT per second (at least not necessarily)
-          << diff(&RawMetrics::cpu_user) / milliseconds(1)
-          << " cpu_user_milliseconds\t"
-          // Note: NOT per second (at least not necessarily)
-          << diff(&RawMetrics::cpu_system) / milliseconds(1)
-          << " cpu_system_milliseconds\t"
-          << scaled_diff(&RawMetrics::page_faults_minor)
-          << " minor_page_faults/s\t"
-          << scaled_diff(&RawMetrics::page_faults_major)
-          << " major_page_faults/s\t" << scaled_diff(&RawMetrics::yields)
-          << " yields/s\t" << scaled_diff(&RawMetrics::preempts)
-          << " preempts/s\n";
-  return sstream.str();
+// Return the `OpTable` of the calling thread, which should be used for all of
+// the rings that the thread submits to.
+OpTable &op_table() {
+  thread_local OpTable table;
+  return table;
 }
 
-// Consume from `conn1fd` and duplicate all data onto `connfd1` and `connfd2`.
-// Use `splice()` and `tee()`, involving the pipes `pipe1fds` and `pipe2fds`,
-// to prevent any copies of data into user space.
-int server_splicetee(int bufsize, io_uring &ring, int conn1fd, int conn2fd,
-                     int (&pipe1fds)[2], int (&pipe2fds)[2]) {
-  const auto interval = std::chrono::seconds(1);
-  const auto start = std::chrono::steady_clock::now();
-  Metrics metrics;
-  metrics.snapshot.when = start;
-
-  const int splice_size = bufsize;
-  std::ofstream log("log");
+// A queue of trace records produced by one thread and consumed by the
+// `Tracer`'s flusher thread. The producer never blocks: if the queue is full,
+// the record is dropped and counted instead.
+class TraceBuffer {
+  static constexpr std::uint64_t capacity = 1 << 16;
 
-  for (;;) {
-    const auto now = std::chrono::steady_clock::now();
-    if (now - metrics.snapshot.when >= interval) {
-      URING_REQUIRE(get_resource_usage(metrics));
-      const std::string message = log_snapshot_diff(start, now, metrics);
-      std::cout << message << std::flush;
-      log << message << std::flush;
-      metrics.snapshot.when = now;
-      static_cast<RawMetrics &>(metrics.snapshot) = metrics;
-    }
+  const std::unique_ptr<TraceRecord[]> records;
+  alignas(64) std::atomic<std::uint64_t> head;  // written by the consumer
+  alignas(64) std::atomic<std::uint64_t> tail;  // written by the producer
+  std::atomic<std::uint64_t> dropped;
+  std::uint64_t dropped_reported;  // used by the consumer only
 
-    io_uring_sqe *sqe;
-    io_uring_cqe *cqe;
-    IOEntryContext io_ctx;
+ public:
+  const std::uint32_t thread;
 
-    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
-    io_ctx.op = IOEntryContext::SPLICE;
-    io_ctx.bytes_desired = splice_size;
-    io_ctx.from_fd = conn1fd;
-    io_ctx.to_fd = pipe1fds[1];
-    io_uring_prep(sqe, io_ctx);
-    sqe->flags |= IOSQE_IO_HARDLINK;
+  explicit TraceBuffer(std::uint32_t thread)
+      : records(new TraceRecord[capacity]),
+        head(0),
+        tail(0),
+        dropped(0),
+        dropped_reported(0),
+        thread(thread) {}
 
-    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
-    io_ctx.op = IOEntryContext::TEE;
-    io_ctx.bytes_desired = splice_size;
-    io_ctx.from_fd = pipe1fds[0];
-    io_ctx.to_fd = pipe2fds[1];
-    io_uring_prep(sqe, io_ctx);
+  void push(const TraceRecord &record) {
+    const std::uint64_t end = tail.load(std::memory_order_relaxed);
+    if (end - head.load(std::memory_order_acquire) == capacity) {
+      dropped.store(dropped.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+      return;
+    }
+    records[end % capacity] = record;
+    tail.store(end + 1, std::memory_order_release);
+  }
 
-    // std::cerr << "Submitting two chained operations to io_uring.\n";
-    io_uring_submit(&ring);
+  // Write all queued records to the specified `fd` as one block. Return zero
+  // on success or `-errno` if an error occurs.
+  int drain(int fd) {
+    const std::uint64_t begin = head.load(std::memory_order_relaxed);
+    const std::uint64_t end = tail.load(std::memory_order_acquire);
+    const std::uint64_t total_dropped = dropped.load(std::memory_order_relaxed);
+    if (begin == end && total_dropped == dropped_reported) {
+      return 0;
+    }
 
-    int bytes_to_send;
+    TraceBlockHeader header = {};
+    header.thread = thread;
+    header.count = end - begin;
+    header.dropped = total_dropped - dropped_reported;
 
-    for (int i = 0; i < 2; i++) {
-      // std::cerr << "Waiting for a completion from io_uring.\n";
-      URING_REQUIRE(io_uring_wait_cqe(&ring, &cqe));
-      URING_REQUIRE(cqe->res);
-      const int result = cqe->res;
-      io_ctx = std::bit_cast<IOEntryContext>(io_uring_cqe_get_data64(cqe));
-      io_uring_cqe_seen(&ring, cqe);
-      if (result < io_ctx.bytes_desired) {
-        switch (io_ctx.op) {
-          case IOEntryContext::SPLICE:
-            ++metrics.short_reads;
-            break;
-          case IOEntryContext::TEE:
-            ++metrics.short_writes_pipe;
-            break;
-          default:
-            break;
-        }
-      }
-      if (io_ctx.op == IOEntryContext::SPLICE && io_ctx.from_fd == conn1fd &&
-          result == 0) {
-        std::cerr << "Nothing more to read.\n";
-        return 0;
+    // The queued records might wrap around the end of `records`.
+    const std::uint64_t first = begin % capacity;
+    const std::uint64_t contiguous = std::min(end - begin, capacity - first);
+    iovec parts[] = {
+        {&header, sizeof header},
+        {&records[first], contiguous * sizeof(TraceRecord)},
+        {&records[0], (end - begin - contiguous) * sizeof(TraceRecord)},
+    };
+    std::size_t remaining = 0;
+    for (const iovec &part : parts) {
+      remaining += part.iov_len;
+    }
+    for (iovec *part = parts; remaining;) {
+      ssize_t rc;
+      POSIX_REQUIRE(rc = writev(fd, part, std::end(parts) - part));
+      remaining -= rc;
+      for (; part != std::end(parts) && std::size_t(rc) >= part->iov_len;
+           ++part) {
+        rc -= part->iov_len;
       }
-      if (i == 0) {
-        bytes_to_send = result;
-      } else {
-        // TODO: Can we tee() less than we splice()? Maybe if conn2 is slow?
-        bytes_to_send = std::min(bytes_to_send, result);
+      if (part != std::end(parts)) {
+        part->iov_base = static_cast<char *>(part->iov_base) + rc;
+        part->iov_len -= rc;
       }
     }
 
-    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
-    io_ctx.op = IOEntryContext::SPLICE;
+    head.store(end, std::memory_order_release);
+    dropped_reported = total_dropped;
+    return 0;
+  }
+};
+
+// Writes a binary trace (see trace.h) of the operations submitted and reaped
+// by threads that have called `register_thread`. A background thread flushes
+// each thread's `TraceBuffer` to the trace file every `flush_interval`, so
+// that the traced threads never wait on the file.
+class Tracer {
+  static constexpr auto flush_interval = std::chrono::milliseconds(10);
+
+  int fd = -1;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<TraceBuffer>> buffers;
+  std::jthread flusher;
+
+  void flush() {
+    std::lock_guard lock(mutex);
+    for (const auto &buffer : buffers) {
+      if (const int rc = buffer->drain(fd)) {
+        std::cerr << "Unable to write trace: " << std::strerror(-rc) << '\n';
+      }
+    }
+  }
+
+ public:
+  Tracer() = default;
+  Tracer(const Tracer &) = delete;
+  Tracer &operator=(const Tracer &) = delete;
+
+  ~Tracer() {
+    if (fd < 0) {
+      return;
+    }
+    flusher.request_stop();
+    flusher.join();
+    flush();
+    close(fd);
+  }
+
+  // Create the trace file at the specified `path` and begin flushing. Return
+  // zero on success or `-errno` if an error occurs.
+  int open(const std::string &path) {
+    POSIX_REQUIRE(fd = ::open(path.c_str(),
+                              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    TraceFileHeader header = {};
+    std::copy_n(trace_magic, sizeof header.magic, header.magic);
+    header.record_size = sizeof(TraceRecord);
+    POSIX_REQUIRE(write(fd, &header, sizeof header));
+
+    flusher = std::jthread([this](std::stop_token stop) {
+      while (!stop.stop_requested()) {
+        std::this_thread::sleep_for(flush_interval);
+        flush();
+      }
+    });
+    return 0;
+  }
+
+  // Return whether a trace file is open.
+  bool enabled() const { return fd >= 0; }
+
+  // Begin tracing the operations of the calling thread.
+  void register_thread() {
+    std::lock_guard lock(mutex);
+    buffers.push_back(std::make_unique<TraceBuffer>(buffers.size()));
+    trace_buffer = buffers.back().get();
+  }
+
+  // The calling thread's buffer, or null if the thread is not being traced.
+  static thread_local TraceBuffer *trace_buffer;
+  // The calling thread's current iteration of its forwarding loop.
+  static thread_local std::uint32_t chunk;
+};
+
+thread_local TraceBuffer *Tracer::trace_buffer = nullptr;
+thread_local std::uint32_t Tracer::chunk = 0;
+
+// Record an event concerning the operation described by `io_ctx` if the
+// calling thread is being traced.
+void trace(TraceKind kind, IOEntryContext io_ctx, unsigned flags = 0,
+           int result = 0) {
+  TraceBuffer *const buffer = Tracer::trace_buffer;
+  if (!buffer) {
+    return;
+  }
+  TraceRecord record = {};
+  record.nanoseconds = std::chrono::steady_clock::now().time_since_epoch() /
+                       std::chrono::nanoseconds(1);
+  record.chunk = Tracer::chunk;
+  record.kind = kind;
+  record.op = io_ctx.op;
+  record.flags = flags;
+  record.from_fd = io_ctx.from_fd;
+  record.to_fd = io_ctx.to_fd;
+  record.requested = io_ctx.bytes_desired;
+  record.result = result;
+  buffer->push(record);
+}
+
+// Record `io_ctx` as the context of `sqe` in the calling thread's `OpTable`,
+// and trace the submission with the specified SQE `flags`.
+void set_context(io_uring_sqe *sqe, const IOEntryContext &io_ctx,
+                 unsigned flags = 0) {
+  io_uring_sqe_set_data64(sqe, op_table().insert(io_ctx));
+  trace(TRACE_SQE, io_ctx, flags);
+}
+
+// Return the context of the operation that produced `cqe`, and forget it
+// unless the operation is multishot and will complete again. Return nothing if
+// the completion is stale (see `OpTable`).
+std::optional<IOEntryContext> take_context(const io_uring_cqe *cqe) {
+  const std::uint64_t user_data = io_uring_cqe_get_data64(cqe);
+  if (cqe->flags & IORING_CQE_F_MORE) {
+    return op_table().find(user_data);
+  }
+  return op_table().take(user_data);
+}
+
+// Wait for a completion on `ring` that is not stale, trace it, and load it
+// into `cqe`. Stale completions are marked seen and otherwise ignored. Return
+// zero on success or a negative error code if an error occurs.
+int wait_fresh_cqe(io_uring &ring, io_uring_cqe **cqe) {
+  for (;;) {
+    URING_REQUIRE(io_uring_wait_cqe(&ring, cqe));
+    if (const std::optional<IOEntryContext> io_ctx =
+            op_table().find(io_uring_cqe_get_data64(*cqe))) {
+      trace(TRACE_CQE, *io_ctx, (*cqe)->flags, (*cqe)->res);
+      return 0;
+    }
+    io_uring_cqe_seen(&ring, *cqe);
+  }
+}
+
+// Prepare `sqe` for the operation described by `io_ctx`. For `TIMEOUT`,
+// `buffer` points to the `__kernel_timespec` at which the timeout expires, for
+// `RECVMSG`, to the `msghdr` to receive into, for `CONNECT`, to the
+// `sockaddr` to connect to, and for `SPLICE`, if not null, to the offset in
+// the file `to_fd` at which to write.
+void io_uring_prep(io_uring_sqe *sqe, IOEntryContext io_ctx, int flags = 0,
+                   char *buffer = nullptr) {
+  switch (io_ctx.op) {
+    case IOEntryContext::TEE:
+      io_uring_prep_tee(sqe, io_ctx.from_fd, io_ctx.to_fd, io_ctx.bytes_desired,
+                        0);
+      break;
+    case IOEntryContext::SPLICE:
+      io_uring_prep_splice(
+          sqe, io_ctx.from_fd, -1, io_ctx.to_fd,
+          buffer ? *reinterpret_cast<const std::int64_t *>(buffer) : -1,
+          io_ctx.bytes_desired, flags);
+      break;
+    case IOEntryContext::SEND:
+      io_uring_prep_send(sqe, io_ctx.to_fd, buffer, io_ctx.bytes_desired,
+                         flags);
+      break;
+    case IOEntryContext::RECV:
+      io_uring_prep_recv(sqe, io_ctx.from_fd, buffer, io_ctx.bytes_desired,
+                         flags);
+      break;
+    case IOEntryContext::TIMEOUT:
+      io_uring_prep_timeout(
+          sqe, reinterpret_cast<__kernel_timespec *>(buffer), 0,
+          flags | IORING_TIMEOUT_ABS);
+      break;
+    case IOEntryContext::ACCEPT:
+      io_uring_prep_multishot_accept(sqe, io_ctx.from_fd, nullptr, nullptr,
+                                     flags | SOCK_CLOEXEC);
+      break;
+    case IOEntryContext::CLOSE:
+      io_uring_prep_close(sqe, io_ctx.from_fd);
+      break;
+    case IOEntryContext::MESSAGE:
+      io_uring_prep_msg_ring(sqe, io_ctx.to_fd, io_ctx.from_fd,
+                             OpTable::message_data(io_ctx.step), 0);
+      break;
+    case IOEntryContext::RECVMSG:
+      io_uring_prep_recvmsg(sqe, io_ctx.from_fd,
+                            reinterpret_cast<msghdr *>(buffer), flags);
+      break;
+    case IOEntryContext::CONNECT:
+      io_uring_prep_connect(sqe, io_ctx.to_fd,
+                            reinterpret_cast<const sockaddr *>(buffer),
+                            io_ctx.bytes_desired);
+      break;
+    default:
+      std::unreachable();
+  }
+  set_context(sqe, io_ctx, flags);
+}
+
+// Steps of the operations that `server_connections` and `client_connections`
+// perform on each of their many connections. Those before `CONNECTION_TICK`
+// concern one use of one connection.
+enum ConnectionStep {
+  CONNECTION_RECV,
+  CONNECTION_SEND,
+  CONNECTION_SPLICE_IN,
+  CONNECTION_SPLICE_OUT,
+  // In proxy mode, connecting to the backend, from the backend into the return
+  // pipe, and from there to the client.
+  CONNECTION_CONNECT,
+  CONNECTION_RETURN_IN,
+  CONNECTION_RETURN_OUT,
+  // A timeout of the whole loop rather than of one connection.
+  CONNECTION_TICK,
+  // Accepting connections, handing one to another thread or receiving one
+  // from the acceptor process, and closing one that is no longer used.
+  CONNECTION_ACCEPT,
+  CONNECTION_HANDOFF,
+  CONNECTION_CLOSE,
+};
+
+// Return a free SQE of `ring`, first submitting those queued if there is none,
+// or return null if there is still none.
+io_uring_sqe *get_sqe_or_submit(io_uring &ring) {
+  if (io_uring_sqe *const sqe = io_uring_get_sqe(&ring)) {
+    return sqe;
+  }
+  io_uring_submit(&ring);
+  return io_uring_get_sqe(&ring);
+}
+
+// Set `when` to the specified `time` of `std::chrono::steady_clock`.
+void to_timespec(std::chrono::steady_clock::time_point time,
+                 __kernel_timespec &when) {
+  using namespace std::chrono;
+  const auto since_epoch = time.time_since_epoch();
+  when.tv_sec = duration_cast<seconds>(since_epoch).count();
+  when.tv_nsec = (since_epoch % seconds(1)).count();
+}
+
+// Log-linear buckets for latencies in nanoseconds, after HdrHistogram: values
+// below 16 have a bucket each, and every larger power of two is divided into
+// 16 buckets, so that bucket widths are within 1/16 of the values in them.
+struct LatencyBuckets {
+  static constexpr int sub_bucket_bits = 4;
+  static constexpr std::size_t count = (64 - sub_bucket_bits + 1)
+                                       << sub_bucket_bits;
+
+  static std::size_t index(std::uint64_t nanoseconds) {
+    const int exponent = std::bit_width(nanoseconds) - 1;
+    if (exponent < sub_bucket_bits) {
+      return nanoseconds;
+    }
+    const int shift = exponent - sub_bucket_bits;
+    return ((shift + 1) << sub_bucket_bits) +
+           ((nanoseconds >> shift) & ((1 << sub_bucket_bits) - 1));
+  }
+
+  // Return the middle of the range of values in the bucket at `index`.
+  static double midpoint(std::size_t index) {
+    if (index < (1 << sub_bucket_bits)) {
+      return index;
+    }
+    const int shift = (index >> sub_bucket_bits) - 1;
+    const std::uint64_t lower =
+        ((index & ((1 << sub_bucket_bits) - 1)) | (1 << sub_bucket_bits))
+        << shift;
+    return lower + ((std::uint64_t(1) << shift) - 1) / 2.0;
+  }
+
+  // Return the approximate `fraction` quantile, in nanoseconds, of the
+  // latencies whose bucket counts are `counts`, or zero if there are none.
+  static double quantile(std::span<const std::uint64_t> counts,
+                         double fraction) {
+    std::uint64_t total = 0;
+    for (const std::uint64_t n : counts) {
+      total += n;
+    }
+    if (!total) {
+      return 0;
+    }
+    const std::uint64_t rank =
+        std::min(total, std::uint64_t(std::ceil(fraction * total)));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+      seen += counts[i];
+      if (seen >= std::max<std::uint64_t>(rank, 1)) {
+        return midpoint(i);
+      }
+    }
+    std::unreachable();
+  }
+};
+
+using LatencyCounts = std::array<std::uint64_t, LatencyBuckets::count>;
+
+// Sizes of the writes of the echo client and of the reads of the server,
+// drawn from a workload profile, one of
+//
+//     fixed[:<bytes>]                   always the same (default: bufsize)
+//     uniform:<min>:<max>               uniform between the bounds
+//     bimodal:<small>:<large>:<p>       `large` with probability `p`
+//     pareto:<min>:<alpha>[:<max>]      Pareto, truncated (default: 1 MiB)
+//     replay:<path>                     the sizes listed in a file, one per
+//                                       line, over and over
+class SizeDistribution {
+  enum Kind { FIXED, UNIFORM, BIMODAL, PARETO, REPLAY };
+
+  Kind kind = FIXED;
+  int low = 0;
+  int high = 0;
+  double parameter = 0;
+  std::shared_ptr<const std::vector<int>> replay;
+  std::size_t replay_index = 0;
+  std::mt19937_64 random;
+
+ public:
+  // Return the distribution described by `profile`, in which `bufsize` is
+  // the default fixed size, or return nothing if `profile` is malformed.
+  static std::optional<SizeDistribution> parse(std::string_view profile,
+                                               int bufsize) {
+    std::vector<std::string> words;
+    for (const auto word : std::views::split(profile, ':')) {
+      words.emplace_back(word.begin(), word.end());
+    }
+    if (words.empty()) {
+      return std::nullopt;
+    }
+    const auto number = [&](std::size_t i) { return std::stod(words[i]); };
+    // Sizes must be positive and fit in an int before they are converted.
+    const auto size = [&](std::size_t i) {
+      const double value = number(i);
+      if (!(value >= 1 && value <= std::numeric_limits<int>::max())) {
+        throw std::out_of_range(words[i]);
+      }
+      return int(value);
+    };
+    SizeDistribution sizes;
+    try {
+      if (words[0] == "fixed" && words.size() <= 2) {
+        sizes.low = sizes.high = words.size() == 2 ? size(1) : bufsize;
+      } else if (words[0] == "uniform" && words.size() == 3) {
+        sizes.kind = UNIFORM;
+        sizes.low = size(1);
+        sizes.high = size(2);
+      } else if (words[0] == "bimodal" && words.size() == 4) {
+        sizes.kind = BIMODAL;
+        sizes.low = size(1);
+        sizes.high = size(2);
+        sizes.parameter = number(3);
+        if (!(sizes.parameter >= 0 && sizes.parameter <= 1)) {
+          return std::nullopt;
+        }
+      } else if (words[0] == "pareto" && words.size() >= 3 &&
+                 words.size() <= 4) {
+        sizes.kind = PARETO;
+        sizes.low = size(1);
+        sizes.parameter = number(2);
+        sizes.high = words.size() == 4 ? size(3) : 1 << 20;
+        if (!(sizes.parameter > 0 && std::isfinite(sizes.parameter))) {
+          return std::nullopt;
+        }
+      } else if (words[0] == "replay" && words.size() == 2) {
+        sizes.kind = REPLAY;
+        auto replay = std::make_shared<std::vector<int>>();
+        std::ifstream in(words[1]);
+        for (int size; in >> size;) {
+          if (size > 0) {
+            replay->push_back(size);
+            sizes.high = std::max(sizes.high, size);
+          }
+        }
+        if (replay->empty()) {
+          std::cerr << "No sizes in " << words[1] << '\n';
+          return std::nullopt;
+        }
+        sizes.low = *std::ranges::min_element(*replay);
+        sizes.replay = std::move(replay);
+      } else {
+        return std::nullopt;
+      }
+    } catch (const std::logic_error &) {
+      return std::nullopt;
+    }
+    if (sizes.low < 1 || sizes.high < sizes.low) {
+      return std::nullopt;
+    }
+    return sizes;
+  }
+
+  // Start a different sequence of sizes, e.g. for a different process.
+  void seed(std::uint64_t value) {
+    random.seed(value);
+    if (replay) {
+      replay_index = value % replay->size();
+    }
+  }
+
+  // Return the largest size that `next()` can return.
+  int max() const { return high; }
+
+  int next() {
+    switch (kind) {
+      case FIXED:
+        return low;
+      case UNIFORM:
+        return std::uniform_int_distribution<int>(low, high)(random);
+      case BIMODAL:
+        return std::bernoulli_distribution(parameter)(random) ? high : low;
+      case PARETO: {
+        const double uniform =
+            std::uniform_real_distribution<double>(0, 1)(random);
+        const double size = low / std::pow(1 - uniform, 1 / parameter);
+        return int(std::min<double>(size, high));
+      }
+      case REPLAY: {
+        const int size = (*replay)[replay_index];
+        replay_index = (replay_index + 1) % replay->size();
+        return size;
+      }
+    }
+    std::unreachable();
+  }
+};
+
+// With `--tune`, chooses the size of the server's reads from the echo
+// connection at run time. Each candidate number of pages is measured for an
+// epoch, after letting data queued at the previous size drain, by the bytes
+// read per second. First the powers of two up to `max_pages` are measured,
+// smallest first. Then the best of them is compared with its neighbours at
+// half its size, moving to a neighbour that is better, and again at half that
+// distance, until the distance is zero. Sizes above one at which most reads
+// came back short are not considered, since the connection seldom has that
+// much data ready. Once converged, the search starts over if throughput falls
+// well below what it was.
+class SizeTuner {
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr auto epoch = std::chrono::milliseconds(100);
+  static constexpr auto settle = std::chrono::milliseconds(10);
+  // A neighbour must be better than the best by this fraction to replace it.
+  static constexpr double margin = 0.02;
+  // Once converged, the search starts over after `patience` epochs in a row
+  // whose throughput was lower than at convergence by more than `drift`.
+  static constexpr double drift = 0.1;
+  static constexpr int patience = 3;
+
+  const int page_size;
+  const int limit;
+  // The largest number of pages considered, lowered by short reads.
+  int max_pages;
+  // The number of pages being measured, and the best number so far.
+  int pages;
+  int best;
+  // Distance of the neighbours of `best` being compared with it, or zero
+  // before the powers of two have been measured.
+  int step = 0;
+  bool converged = false;
+  double converged_throughput = 0;
+  int slow_epochs = 0;
+  // Candidates left to measure before choosing, last first, and the throughput
+  // measured for each candidate, by number of pages.
+  std::vector<int> pending;
+  std::vector<double> throughputs;
+  Clock::time_point measure_start;
+  std::uint64_t bytes = 0;
+  std::uint64_t reads = 0;
+  std::uint64_t short_reads = 0;
+
+  void measure(int candidate, Clock::time_point now) {
+    pages = candidate;
+    measure_start = now + settle;
+    bytes = reads = short_reads = 0;
+  }
+
+  // Queue `best` and its neighbours at `step` for comparison.
+  void compare_neighbours() {
+    pending.clear();
+    if (best + step <= max_pages) {
+      pending.push_back(best + step);
+    }
+    if (best - step >= 1) {
+      pending.push_back(best - step);
+    }
+    pending.push_back(best);
+  }
+
+  void end_epoch(double throughput, Clock::time_point now) {
+    throughputs[pages] = throughput;
+    if (short_reads * 2 > reads && pages < max_pages) {
+      max_pages = pages;
+      std::erase_if(pending, [&](int candidate) { return candidate > pages; });
+    }
+    if (converged) {
+      slow_epochs =
+          throughput < converged_throughput * (1 - drift) ? slow_epochs + 1 : 0;
+      if (slow_epochs < patience) {
+        return measure(pages, now);
+      }
+      converged = false;
+      max_pages = limit;
+      step = std::max(1, best / 2);
+      compare_neighbours();
+    }
+    if (pending.empty()) {
+      if (!step) {
+        for (int candidate = 1; candidate <= max_pages; candidate *= 2) {
+          if (throughputs[candidate] > throughputs[best]) {
+            best = candidate;
+          }
+        }
+        step = std::max(1, best / 2);
+      } else {
+        int better = best;
+        for (const int candidate : {best - step, best + step}) {
+          if (candidate >= 1 && candidate <= max_pages &&
+              throughputs[candidate] >
+                  throughputs[better] * (better == best ? 1 + margin : 1)) {
+            better = candidate;
+          }
+        }
+        best = better;
+        step /= 2;
+      }
+      if (!step) {
+        converged = true;
+        converged_throughput = throughputs[best];
+        slow_epochs = 0;
+        return measure(best, now);
+      }
+      compare_neighbours();
+    }
+    const int next = pending.back();
+    pending.pop_back();
+    measure(next, now);
+  }
+
+ public:
+  // Create a tuner of reads of from one to `max_pages` pages of `page_size`
+  // bytes.
+  SizeTuner(int page_size, int max_pages)
+      : page_size(page_size),
+        limit(max_pages),
+        max_pages(max_pages),
+        pages(1),
+        best(1),
+        throughputs(max_pages + 1) {
+    for (int candidate = 1; candidate <= max_pages; candidate *= 2) {
+      pending.insert(pending.begin(), candidate);
+    }
+    pending.pop_back();
+    measure(1, Clock::now());
+  }
+
+  // Return the number of bytes to read next.
+  int size() const { return pages * page_size; }
+
+  // Return the number of pages being read, the best number found so far, and
+  // whether the search has converged on it.
+  int current_pages() const { return pages; }
+  int best_pages() const { return best; }
+  bool has_converged() const { return converged; }
+
+  // Account for a read of `requested` bytes that returned `result` bytes, and
+  // move on to the next candidate size at the end of an epoch.
+  void record(int requested, int result) {
+    const Clock::time_point now = Clock::now();
+    if (now < measure_start) {
+      return;
+    }
+    bytes += result;
+    ++reads;
+    short_reads += result < requested;
+    const std::chrono::duration<double> elapsed = now - measure_start;
+    if (elapsed >= epoch) {
+      end_epoch(bytes / elapsed.count(), now);
+    }
+  }
+};
+
+// With `--verify`, the echo client sends a pattern in which the 8-byte word at
+// each stream offset `8 * k` is `k * pattern_step` in host byte order, and the
+// clients check that what they receive is the pattern at the same offset. Any
+// byte that is corrupted, reordered, duplicated or dropped on the way breaks
+// the match.
+constexpr std::uint64_t pattern_step = 0x9E3779B97F4A7C15;
+
+char pattern_byte(std::uint64_t offset) {
+  return char((offset / 8 * pattern_step) >> (offset % 8 * 8));
+}
+
+#if defined(__x86_64__)
+// Fill the `words` 8-byte words at `data` with the pattern, starting with word
+// `first`, except for the last partial block of four. Return how many were
+// filled. SSE2 is always available on x86-64, and AVX2 usually.
+__attribute__((target("avx2"))) std::size_t fill_pattern_words_avx2(
+    char *data, std::size_t words, std::uint64_t first) {
+  __m256i expected = _mm256_set_epi64x(
+      (first + 3) * pattern_step, (first + 2) * pattern_step,
+      (first + 1) * pattern_step, first * pattern_step);
+  const __m256i step = _mm256_set1_epi64x(4 * pattern_step);
+  std::size_t i = 0;
+  for (; i + 4 <= words; i += 4) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + 8 * i), expected);
+    expected = _mm256_add_epi64(expected, step);
+  }
+  return i;
+}
+
+// Return how many of the `words` 8-byte words at `data` match the pattern,
+// starting with word `first`, before the first block of four that does not,
+// or before the last partial block.
+__attribute__((target("avx2"))) std::size_t match_pattern_words_avx2(
+    const char *data, std::size_t words, std::uint64_t first) {
+  __m256i expected = _mm256_set_epi64x(
+      (first + 3) * pattern_step, (first + 2) * pattern_step,
+      (first + 1) * pattern_step, first * pattern_step);
+  const __m256i step = _mm256_set1_epi64x(4 * pattern_step);
+  std::size_t i = 0;
+  for (; i + 4 <= words; i += 4) {
+    const __m256i actual =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 8 * i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(actual, expected)) != -1) {
+      break;
+    }
+    expected = _mm256_add_epi64(expected, step);
+  }
+  return i;
+}
+
+std::size_t fill_pattern_words_sse2(char *data, std::size_t words,
+                                    std::uint64_t first) {
+  __m128i expected =
+      _mm_set_epi64x((first + 1) * pattern_step, first * pattern_step);
+  const __m128i step = _mm_set1_epi64x(2 * pattern_step);
+  std::size_t i = 0;
+  for (; i + 2 <= words; i += 2) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(data + 8 * i), expected);
+    expected = _mm_add_epi64(expected, step);
+  }
+  return i;
+}
+
+std::size_t match_pattern_words_sse2(const char *data, std::size_t words,
+                                     std::uint64_t first) {
+  __m128i expected =
+      _mm_set_epi64x((first + 1) * pattern_step, first * pattern_step);
+  const __m128i step = _mm_set1_epi64x(2 * pattern_step);
+  std::size_t i = 0;
+  for (; i + 2 <= words; i += 2) {
+    const __m128i actual =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 8 * i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(actual, expected)) != 0xffff) {
+      break;
+    }
+    expected = _mm_add_epi64(expected, step);
+  }
+  return i;
+}
+
+const bool have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+// Fill `data` with the pattern found at stream `offset`.
+void fill_pattern(std::span<char> data, std::uint64_t offset) {
+  std::size_t i = 0;
+  for (; i < data.size() && (offset + i) % 8; ++i) {
+    data[i] = pattern_byte(offset + i);
+  }
+#if defined(__x86_64__)
+  const std::size_t words = (data.size() - i) / 8;
+  i += 8 * (have_avx2 ? fill_pattern_words_avx2(data.data() + i, words,
+                                                 (offset + i) / 8)
+                      : fill_pattern_words_sse2(data.data() + i, words,
+                                                 (offset + i) / 8));
+#endif
+  for (; i < data.size(); ++i) {
+    data[i] = pattern_byte(offset + i);
+  }
+}
+
+// Return the number of leading bytes of `data` that match the pattern found
+// at stream `offset`.
+std::size_t match_pattern(std::span<const char> data, std::uint64_t offset) {
+  std::size_t i = 0;
+  for (; i < data.size() && (offset + i) % 8; ++i) {
+    if (data[i] != pattern_byte(offset + i)) {
+      return i;
+    }
+  }
+#if defined(__x86_64__)
+  const std::size_t words = (data.size() - i) / 8;
+  i += 8 * (have_avx2 ? match_pattern_words_avx2(data.data() + i, words,
+                                                  (offset + i) / 8)
+                      : match_pattern_words_sse2(data.data() + i, words,
+                                                  (offset + i) / 8));
+#endif
+  for (; i < data.size(); ++i) {
+    if (data[i] != pattern_byte(offset + i)) {
+      return i;
+    }
+  }
+  return i;
+}
+
+// Counters that a forked client publishes so that the server can include the
+// client's share of the work in its log. Each client is the only writer of its
+// `ClientCounters`, which live in a `MAP_SHARED` mapping created before
+// `fork()` (see `map_shared`).
+struct ClientCounters {
+  std::atomic<std::uint64_t> bytes_sent;
+  std::atomic<std::uint64_t> bytes_received;
+  std::atomic<std::uint64_t> cpu_user_microseconds;
+  std::atomic<std::uint64_t> cpu_system_microseconds;
+  // Echo latencies measured by the client (see `client_open_loop` and
+  // `client_connections`).
+  std::array<std::atomic<std::uint64_t>, LatencyBuckets::count> latency_counts;
+  // With `--verify`, bytes checked against the pattern, and receives that did
+  // not match it.
+  std::atomic<std::uint64_t> verified_bytes;
+  std::atomic<std::uint64_t> verify_errors;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+// Return a zeroed array of `count` `T`, e.g. `ClientCounters`, in memory that
+// will be shared with child processes created by subsequent calls to `fork()`,
+// or return null if an error occurs.
+template <typename T>
+T *map_shared(int count) {
+  void *const memory = mmap(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    const int err = errno;
+    std::cerr << "Unable to map shared counters: " << std::strerror(err)
+              << '\n';
+    return nullptr;
+  }
+  return new (memory) T[count]();
+}
+
+// Periodically copies a client's byte counts and resource usage into its
+// `ClientCounters`. The byte counts are kept locally and published together
+// with the resource usage, so that the hot path touches no shared cache lines.
+class ClientPublisher {
+  ClientCounters &counters;
+  std::chrono::steady_clock::time_point next_publish;
+
+ public:
+  static constexpr auto interval = std::chrono::milliseconds(100);
+
+  std::uint64_t bytes_sent = 0;
+  std::uint64_t bytes_received = 0;
+  LatencyCounts latency_counts = {};
+  std::uint64_t verified_bytes = 0;
+  std::uint64_t verify_errors = 0;
+
+  explicit ClientPublisher(ClientCounters &counters)
+      : counters(counters), next_publish() {}
+
+  ~ClientPublisher() { publish(); }
+
+  void maybe_publish() {
+    if (std::chrono::steady_clock::now() >= next_publish) {
+      publish();
+    }
+  }
+
+  void publish() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    counters.cpu_user_microseconds.store(
+        usage.ru_utime.tv_sec * 1'000'000 + usage.ru_utime.tv_usec,
+        std::memory_order_relaxed);
+    counters.cpu_system_microseconds.store(
+        usage.ru_stime.tv_sec * 1'000'000 + usage.ru_stime.tv_usec,
+        std::memory_order_relaxed);
+    counters.bytes_sent.store(bytes_sent, std::memory_order_relaxed);
+    counters.bytes_received.store(bytes_received, std::memory_order_relaxed);
+    counters.verified_bytes.store(verified_bytes, std::memory_order_relaxed);
+    counters.verify_errors.store(verify_errors, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < latency_counts.size(); ++i) {
+      if (latency_counts[i]) {
+        counters.latency_counts[i].store(latency_counts[i],
+                                         std::memory_order_relaxed);
+      }
+    }
+    next_publish = std::chrono::steady_clock::now() + interval;
+  }
+
+  // Check that `data`, received at stream offset `bytes_received`, is the
+  // pattern (see `pattern_step`). Report the first few mismatches on behalf of
+  // the specified `client`.
+  void verify(std::span<const char> data, const char *client) {
+    const std::size_t matched = match_pattern(data, bytes_received);
+    verified_bytes += data.size();
+    if (matched == data.size()) {
+      return;
+    }
+    if (++verify_errors <= 10) {
+      const std::uint64_t offset = bytes_received + matched;
+      std::cerr << client << ": payload mismatch at stream offset " << offset
+                << ": expected byte 0x" << std::hex
+                << int(std::uint8_t(pattern_byte(offset))) << ", received 0x"
+                << int(std::uint8_t(data[matched])) << std::dec << '\n';
+    }
+  }
+};
+
+// Connect and `recv()` continuously, discarding all data, after checking that
+// it is the pattern if `verify` is set.
+int client_sink(int bufsize, Net &net, int server_sock,
+                ClientCounters &counters, bool verify) {
+  int sock;
+  URING_REQUIRE(sock = net.client_socket(server_sock));
+
+  ClientPublisher publisher(counters);
+  std::vector<char> buffer(bufsize);
+  for (;;) {
+    int rc;
+    POSIX_REQUIRE(rc = recv(sock, buffer.data(), buffer.size(),
+                            verify ? 0 : MSG_TRUNC));
+    if (rc == 0) {
+      return 0;
+    }
+    if (verify) {
+      publisher.verify({buffer.data(), std::size_t(rc)}, "observer client");
+    }
+    publisher.bytes_received += rc;
+    publisher.maybe_publish();
+  }
+}
+
+// Connect, to rendezvous and to see when the server hangs up, and read
+// everything from the shared-memory ring `from_server`, discarding it.
+int client_shm_sink(Net &net, int server_sock, ClientCounters &counters,
+                    ShmRing &from_server) {
+  int sock;
+  URING_REQUIRE(sock = net.client_socket(server_sock));
+
+  ClientPublisher publisher(counters);
+  for (;;) {
+    if (const std::size_t bytes = from_server.readable().size()) {
+      from_server.consume(bytes);
+      publisher.bytes_received += bytes;
+    } else {
+      const int fds[] = {from_server.wait_readable()};
+      int hung_up;
+      URING_REQUIRE(hung_up = wait_shm(fds, sock, 100));
+      if (hung_up) {
+        return 0;
+      }
+    }
+    publisher.maybe_publish();
+  }
+}
+
+// Connect, to rendezvous and to see when the server hangs up, and
+// concurrently write zeros into the shared-memory ring `to_server`, in writes
+// of `sizes`, and read everything from `from_server`, discarding it. If
+// `depth` is nonzero, write messages of `message_size` bytes instead, at most
+// `depth` of them awaiting their echo, and measure the latency of each from
+// when its writing began until the last of its bytes has been echoed.
+int client_shm_source_and_sink(Net &net, int server_sock,
+                               ClientCounters &counters, ShmRing &to_server,
+                               ShmRing &from_server, SizeDistribution sizes,
+                               int depth, int message_size) {
+  using namespace std::chrono;
+  int sock;
+  URING_REQUIRE(sock = net.client_socket(server_sock));
+
+  ClientPublisher publisher(counters);
+  // What is left to write of the current write or message, when each message
+  // awaiting its echo began to be written, and how many have been echoed.
+  std::size_t write_left = 0;
+  std::deque<steady_clock::time_point> sent;
+  std::uint64_t echoed = 0;
+  for (;;) {
+    if (!write_left && (!depth || sent.size() < std::size_t(depth))) {
+      write_left = depth ? message_size : sizes.next();
+      if (depth) {
+        sent.push_back(steady_clock::now());
+      }
+    }
+    bool progress = false;
+    const std::span<char> room = to_server.writable();
+    if (const std::size_t bytes = std::min(room.size(), write_left)) {
+      std::memset(room.data(), 0, bytes);
+      to_server.commit(bytes);
+      write_left -= bytes;
+      publisher.bytes_sent += bytes;
+      progress = true;
+    }
+    if (const std::size_t bytes = from_server.readable().size()) {
+      from_server.consume(bytes);
+      publisher.bytes_received += bytes;
+      progress = true;
+      const auto now = steady_clock::now();
+      while (depth && (echoed + 1) * message_size <= publisher.bytes_received) {
+        ++publisher.latency_counts[LatencyBuckets::index(
+            (now - sent.front()) / nanoseconds(1))];
+        sent.pop_front();
+        ++echoed;
+      }
+    }
+    if (!progress) {
+      int fds[2];
+      std::size_t count = 0;
+      if (write_left) {
+        fds[count++] = to_server.wait_writable();
+      }
+      fds[count++] = from_server.wait_readable();
+      int hung_up;
+      URING_REQUIRE(hung_up = wait_shm({fds, count}, sock, 100));
+      if (hung_up) {
+        return 0;
+      }
+    }
+    publisher.maybe_publish();
+  }
+}
+
+// Connect and concurrently `send()` zeros, in writes of `sizes`, and
+// `recv()`, discarding all received data. If `verify` is set, send the pattern
+// instead of zeros, and check that the data received is the pattern too.
+int client_source_and_sink(int bufsize, Net &net, int server_sock,
+                           ClientCounters &counters, SizeDistribution sizes,
+                           bool verify) {
+  io_uring ring;
+  URING_REQUIRE(io_uring_queue_init(8, &ring, 0));
+
+  int sock;
+  URING_REQUIRE(sock = net.client_socket(server_sock));
+
+  ClientPublisher publisher(counters);
+  io_uring_sqe *sqe;
+  io_uring_cqe *cqe;
+  IOEntryContext io_ctx = {};
+  std::vector<char> buffer(bufsize);
+  std::vector<char> payload(sizes.max());
+  const auto prep_send = [&]() {
+    sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+      std::cerr << "Panic on line " << __LINE__ << '\n' << std::flush;
+      std::abort();
+    }
+    io_ctx.op = IOEntryContext::SEND;
+    io_ctx.to_fd = sock;
+    io_ctx.bytes_desired = sizes.next();
+    if (verify) {
+      fill_pattern({payload.data(), std::size_t(io_ctx.bytes_desired)},
+                   publisher.bytes_sent);
+    }
+    io_uring_prep(sqe, io_ctx, 0, payload.data());
+  };
+
+  const auto prep_recv = [&]() {
+    sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+      std::cerr << "Panic on line " << __LINE__ << '\n' << std::flush;
+      std::abort();
+    }
+    io_ctx.op = IOEntryContext::RECV;
+    io_ctx.from_fd = sock;
+    io_ctx.bytes_desired = buffer.size();
+    io_uring_prep(sqe, io_ctx, verify ? 0 : MSG_TRUNC, buffer.data());
+  };
+
+  prep_send();
+  prep_recv();
+  io_uring_submit(&ring);
+
+  for (;;) {
+    URING_REQUIRE(io_uring_wait_cqe(&ring, &cqe));
+    URING_REQUIRE(cqe->res);
+    const int result = cqe->res;
+    io_ctx = take_context(cqe).value();
+    io_uring_cqe_seen(&ring, cqe);
+    switch (io_ctx.op) {
+      case IOEntryContext::RECV:
+        if (result == 0) {
+          // Server hung up.
+          return 0;
+        }
+        if (verify) {
+          publisher.verify({buffer.data(), std::size_t(result)},
+                           "echo client");
+        }
+        publisher.bytes_received += result;
+        publisher.maybe_publish();
+        prep_recv();
+        io_uring_submit(&ring);
+        break;
+      case IOEntryContext::SEND:
+        publisher.bytes_sent += result;
+        prep_send();
+        io_uring_submit(&ring);
+        break;
+      default:
+        std::abort();
+    }
+  }
+}
+
+// Connect, `send()` zeros at `rate` bytes per second in messages of
+// `message_size` bytes, and `recv()` the echo. Message `i` is due at
+// `i * message_size / rate` after the start, and its latency is measured from
+// then until the last of its bytes has been echoed. Sends that fall behind
+// schedule are made as soon as possible, so that the time a message spent
+// waiting to be sent counts towards its latency rather than being omitted.
+int client_open_loop(int bufsize, Net &net, int server_sock,
+                     ClientCounters &counters, double rate, int message_size) {
+  io_uring ring;
+  URING_REQUIRE(io_uring_queue_init(8, &ring, 0));
+
+  int sock;
+  URING_REQUIRE(sock = net.client_socket(server_sock));
+
+  using namespace std::chrono;
+  ClientPublisher publisher(counters);
+  io_uring_sqe *sqe;
+  io_uring_cqe *cqe;
+  IOEntryContext io_ctx = {};
+  std::vector<char> buffer(bufsize);
+  std::vector<char> payload(std::max(bufsize, message_size));
+  __kernel_timespec wakeup = {};
+  const auto start = steady_clock::now();
+  const duration<double, std::nano> period(message_size * 1e9 / rate);
+  // Messages whose last byte has been echoed.
+  std::uint64_t echoed = 0;
+
+  const auto due_time = [&](std::uint64_t message) {
+    return start + duration_cast<nanoseconds>(message * period);
+  };
+  const auto get_sqe = [&]() {
+    sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+      std::cerr << "Panic on line " << __LINE__ << '\n' << std::flush;
+      std::abort();
+    }
+  };
+
+  // Send whatever is due, or else time out when the next message is due.
+  const auto prep_send_or_timeout = [&]() {
+    const std::uint64_t due_messages =
+        std::uint64_t((steady_clock::now() - start) / period) + 1;
+    const std::uint64_t due_bytes = due_messages * message_size;
+    get_sqe();
+    if (due_bytes > publisher.bytes_sent) {
+      io_ctx.op = IOEntryContext::SEND;
+      io_ctx.to_fd = sock;
+      io_ctx.bytes_desired = std::min<std::uint64_t>(
+          due_bytes - publisher.bytes_sent, payload.size());
+      io_uring_prep(sqe, io_ctx, 0, payload.data());
+    } else {
+      to_timespec(due_time(due_messages), wakeup);
+      io_ctx.op = IOEntryContext::TIMEOUT;
+      io_ctx.bytes_desired = 0;
+      io_uring_prep(sqe, io_ctx, 0, reinterpret_cast<char *>(&wakeup));
+    }
+  };
+
+  const auto prep_recv = [&]() {
+    get_sqe();
+    io_ctx.op = IOEntryContext::RECV;
+    io_ctx.from_fd = sock;
+    io_ctx.bytes_desired = buffer.size();
+    io_uring_prep(sqe, io_ctx, MSG_TRUNC, buffer.data());
+  };
+
+  prep_send_or_timeout();
+  prep_recv();
+  io_uring_submit(&ring);
+
+  for (;;) {
+    URING_REQUIRE(io_uring_wait_cqe(&ring, &cqe));
+    const int result = cqe->res;
+    io_ctx = take_context(cqe).value();
+    io_uring_cqe_seen(&ring, cqe);
+    if (io_ctx.op == IOEntryContext::TIMEOUT) {
+      if (result != -ETIME) {
+        URING_REQUIRE(result);
+      }
+      prep_send_or_timeout();
+      io_uring_submit(&ring);
+      continue;
+    }
+    URING_REQUIRE(result);
+    switch (io_ctx.op) {
+      case IOEntryContext::RECV: {
+        if (result == 0) {
+          // Server hung up.
+          return 0;
+        }
+        publisher.bytes_received += result;
+        const auto now = steady_clock::now();
+        while ((echoed + 1) * message_size <= publisher.bytes_received) {
+          ++publisher.latency_counts[LatencyBuckets::index(
+              (now - due_time(echoed)) / nanoseconds(1))];
+          ++echoed;
+        }
+        publisher.maybe_publish();
+        prep_recv();
+        io_uring_submit(&ring);
+        break;
+      }
+      case IOEntryContext::SEND:
+        publisher.bytes_sent += result;
+        prep_send_or_timeout();
+        io_uring_submit(&ring);
+        break;
+      default:
+        std::abort();
+    }
+  }
+}
+
+// Connect, and send the stream that a tap captured in the file at `path` (see
+// `Tap`) over and over, while `recv()`ing and discarding the echo. Splice the
+// file into the connection through a pipe, so that its pages go from the page
+// cache to the socket without being copied through user space. If `timing` is
+// set, send each part of the stream when the tap's index "<path>.index" says
+// it was captured, relative to the first, and otherwise as fast as possible,
+// in splices of up to `bufsize` bytes.
+int client_replay(int bufsize, Net &net, int server_sock,
+                  ClientCounters &counters, const std::string &path,
+                  bool timing) {
+  using namespace std::chrono;
+  // When each part of the stream was captured, in nanoseconds, and its size.
+  std::vector<std::pair<std::int64_t, int>> parts;
+  if (timing) {
+    std::ifstream index(path + ".index");
+    std::int64_t nanoseconds;
+    int bytes;
+    while (index >> nanoseconds >> bytes) {
+      parts.emplace_back(nanoseconds, bytes);
+    }
+    if (parts.empty()) {
+      std::cerr << "No timing in " << path << ".index\n";
+      return 1;
+    }
+  }
+
+  io_uring ring;
+  URING_REQUIRE(io_uring_queue_init(8, &ring, 0));
+
+  int file;
+  POSIX_REQUIRE(file = open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  int pipefds[2];
+  POSIX_REQUIRE(pipe(pipefds));
+  int sock;
+  URING_REQUIRE(sock = net.client_socket(server_sock));
+
+  ClientPublisher publisher(counters);
+  io_uring_sqe *sqe;
+  io_uring_cqe *cqe;
+  IOEntryContext io_ctx = {};
+  std::vector<char> buffer(bufsize);
+  // The next part of the stream, what of the current one has yet to be read
+  // from the file, and when the file was last started from the beginning.
+  std::size_t next_part = 0;
+  int part_left = 0;
+  auto start = steady_clock::now();
+  __kernel_timespec wakeup;
+
+  const auto get_sqe = [&]() {
+    sqe = io_uring_get_sqe(&ring);
+    if (!sqe) {
+      std::cerr << "Panic on line " << __LINE__ << '\n' << std::flush;
+      std::abort();
+    }
+  };
+
+  // Start the file over, at its original timing from now on.
+  const auto rewind = [&]() {
+    POSIX_REQUIRE(lseek(file, 0, SEEK_SET));
+    next_part = 0;
+    part_left = 0;
+    start = steady_clock::now();
+    return 0;
+  };
+
+  // Splice from the file into the pipe what is due, or else time out when
+  // the next part is due.
+  const auto prep_read_or_timeout = [&]() {
+    get_sqe();
+    if (timing && !part_left) {
+      if (next_part == parts.size()) {
+        URING_REQUIRE(rewind());
+      }
+      const auto due = start + nanoseconds(parts[next_part].first -
+                                           parts.front().first);
+      if (due > steady_clock::now()) {
+        to_timespec(due, wakeup);
+        io_ctx.op = IOEntryContext::TIMEOUT;
+        io_ctx.bytes_desired = 0;
+        io_uring_prep(sqe, io_ctx, 0, reinterpret_cast<char *>(&wakeup));
+        return 0;
+      }
+      part_left = parts[next_part++].second;
+    }
+    io_ctx.op = IOEntryContext::SPLICE;
+    io_ctx.from_fd = file;
+    io_ctx.to_fd = pipefds[1];
+    io_ctx.bytes_desired = timing ? std::min(part_left, bufsize) : bufsize;
+    io_uring_prep(sqe, io_ctx);
+    return 0;
+  };
+
+  const auto prep_recv = [&]() {
+    get_sqe();
+    io_ctx.op = IOEntryContext::RECV;
+    io_ctx.from_fd = sock;
+    io_ctx.bytes_desired = buffer.size();
+    io_uring_prep(sqe, io_ctx, MSG_TRUNC, buffer.data());
+  };
+
+  URING_REQUIRE(prep_read_or_timeout());
+  prep_recv();
+  io_uring_submit(&ring);
+
+  for (;;) {
+    URING_REQUIRE(io_uring_wait_cqe(&ring, &cqe));
+    const int result = cqe->res;
+    io_ctx = take_context(cqe).value();
+    io_uring_cqe_seen(&ring, cqe);
+    if (io_ctx.op == IOEntryContext::TIMEOUT) {
+      if (result != -ETIME) {
+        URING_REQUIRE(result);
+      }
+      URING_REQUIRE(prep_read_or_timeout());
+      io_uring_submit(&ring);
+      continue;
+    }
+    URING_REQUIRE(result);
+    switch (io_ctx.op) {
+      case IOEntryContext::RECV:
+        if (result == 0) {
+          // Server hung up.
+          return 0;
+        }
+        publisher.bytes_received += result;
+        publisher.maybe_publish();
+        prep_recv();
+        io_uring_submit(&ring);
+        break;
+      case IOEntryContext::SPLICE:
+        if (io_ctx.from_fd == file && result == 0) {
+          // The end of the file, if not of its index.
+          URING_REQUIRE(rewind());
+          URING_REQUIRE(prep_read_or_timeout());
+        } else if (io_ctx.from_fd == file) {
+          part_left = std::max(0, part_left - result);
+          get_sqe();
+          io_ctx.from_fd = pipefds[0];
+          io_ctx.to_fd = sock;
+          io_ctx.bytes_desired = result;
+          io_uring_prep(sqe, io_ctx);
+        } else {
+          publisher.bytes_sent += result;
+          io_ctx.bytes_desired -= result;
+          if (io_ctx.bytes_desired) {
+            get_sqe();
+            io_uring_prep(sqe, io_ctx);
+          } else {
+            URING_REQUIRE(prep_read_or_timeout());
+          }
+        }
+        io_uring_submit(&ring);
+        break;
+      default:
+        std::abort();
+    }
+  }
+}
+
+// Open `count` connections and drive them all from one ring, as the many
+// clients of a busy server would. Each connection repeatedly sends a message
+// and receives its echo, all its messages being of one size drawn from
+// `message_sizes` when the connection is opened. If `rate` is zero, each
+// connection keeps `depth` messages awaiting their echo, sending the next as
+// soon as one has been echoed (closed loop, i.e. request/response).
+// Otherwise, messages are due at `rate` bytes per second in total, in turn
+// from each connection (open loop, as in `client_open_loop`). The latency of
+// each message is measured from when it was due until its echo is complete.
+// If `reconnect` is nonzero, each connection is closed and replaced by a new
+// one, with a new message size, once `reconnect` of its messages have been
+// echoed and nothing is in flight on it.
+int client_connections(int bufsize, Net &net, int server_sock,
+                       ClientCounters &counters, int count, double rate,
+                       SizeDistribution message_sizes, int depth,
+                       int reconnect) {
+  using namespace std::chrono;
+
+  struct Flow {
+    int fd = -1;
+    int message_size = 0;
+    // Bytes that have been due to be sent, and that have been sent.
+    std::uint64_t queued = 0;
+    std::uint64_t sent = 0;
+    std::uint64_t received = 0;
+    // Messages whose last byte has been received.
+    std::uint64_t echoed = 0;
+    bool sending = false;
+    // When the messages sent or queued, but not yet echoed, were due.
+    std::deque<steady_clock::time_point> due;
+  };
+
+  io_uring ring;
+  URING_REQUIRE(io_uring_queue_init(4096, &ring, 0));
+
+  std::vector<Flow> flows(count);
+  int largest = bufsize;
+  for (Flow &flow : flows) {
+    URING_REQUIRE(flow.fd = net.client_socket(server_sock));
+    flow.message_size = message_sizes.next();
+    largest = std::max(largest, flow.message_size);
+  }
+
+  ClientPublisher publisher(counters);
+  // Received data is discarded, so all receives can share one buffer.
+  std::vector<char> buffer(bufsize);
+  std::vector<char> payload(largest);
+  __kernel_timespec wakeup = {};
+  int open = count;
+  const auto start = steady_clock::now();
+  // Index of the next message due, over all connections, in open loop, and
+  // the bytes of the messages before it.
+  std::uint64_t next_message = 0;
+  std::uint64_t due_bytes = 0;
+
+  const auto prep_send = [&](std::uint32_t index) {
+    Flow &flow = flows[index];
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    io_uring_prep(
+        sqe,
+        {.bytes_desired = std::int64_t(std::min<std::uint64_t>(
+             flow.queued - flow.sent, payload.size())),
+         .op = IOEntryContext::SEND,
+         .step = CONNECTION_SEND,
+         .to_fd = flow.fd,
+         .connection = index},
+        MSG_NOSIGNAL, payload.data());
+    flow.sending = true;
+    return 0;
+  };
+  const auto queue_message = [&](std::uint32_t index,
+                                 steady_clock::time_point due) {
+    Flow &flow = flows[index];
+    flow.due.push_back(due);
+    flow.queued += flow.message_size;
+    if (!flow.sending && flow.fd >= 0) {
+      URING_REQUIRE(prep_send(index));
+    }
+    return 0;
+  };
+  // In closed loop, send another message on the connection of `index`
+  // unless it has sent all that it should before reconnecting.
+  const auto queue_request = [&](std::uint32_t index) {
+    const Flow &flow = flows[index];
+    if (rate || (reconnect && flow.queued / flow.message_size >=
+                                  std::uint64_t(reconnect))) {
+      return 0;
+    }
+    return queue_message(index, steady_clock::now());
+  };
+  const auto prep_recv = [&](std::uint32_t index) {
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    io_uring_prep(sqe,
+                  {.bytes_desired = std::int64_t(buffer.size()),
+                   .op = IOEntryContext::RECV,
+                   .step = CONNECTION_RECV,
+                   .from_fd = flows[index].fd,
+                   .connection = index},
+                  MSG_TRUNC, buffer.data());
+    return 0;
+  };
+  // Queue the messages due by now, and time out when the next one is due.
+  const auto on_tick = [&]() {
+    const auto now = steady_clock::now();
+    for (;;) {
+      const auto due = start + duration_cast<nanoseconds>(
+                                   duration<double, std::nano>(
+                                       due_bytes * 1e9 / rate));
+      if (due > now) {
+        to_timespec(due, wakeup);
+        break;
+      }
+      const std::uint32_t index = next_message % count;
+      URING_REQUIRE(queue_message(index, due));
+      due_bytes += flows[index].message_size;
+      ++next_message;
+    }
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    io_uring_prep(sqe,
+                  {.op = IOEntryContext::TIMEOUT, .step = CONNECTION_TICK}, 0,
+                  reinterpret_cast<char *>(&wakeup));
+    return 0;
+  };
+
+  // Replace the connection of `index`, which has nothing in flight, with a
+  // new one.
+  const auto reopen = [&](std::uint32_t index) {
+    Flow &flow = flows[index];
+    close(flow.fd);
+    flow = Flow();
+    URING_REQUIRE(flow.fd = net.client_socket(server_sock));
+    flow.message_size = message_sizes.next();
+    URING_REQUIRE(prep_recv(index));
+    for (int j = 0; j < depth; ++j) {
+      URING_REQUIRE(queue_request(index));
+    }
+    return 0;
+  };
+
+  for (int i = 0; i < count; ++i) {
+    URING_REQUIRE(prep_recv(i));
+    for (int j = 0; j < depth; ++j) {
+      URING_REQUIRE(queue_request(i));
+    }
+  }
+  if (rate) {
+    URING_REQUIRE(on_tick());
+  }
+  io_uring_submit(&ring);
+
+  io_uring_cqe *cqe;
+  while (open) {
+    URING_REQUIRE(io_uring_wait_cqe(&ring, &cqe));
+    const int result = cqe->res;
+    const IOEntryContext io_ctx = take_context(cqe).value();
+    io_uring_cqe_seen(&ring, cqe);
+    const std::uint32_t index = io_ctx.connection;
+    Flow &flow = flows[index];
+    switch (io_ctx.step) {
+      case CONNECTION_TICK:
+        URING_REQUIRE(on_tick());
+        break;
+      case CONNECTION_SEND:
+        if (result <= 0) {
+          // The server hung up or the connection failed. Retire it now rather
+          // than waiting for the server to close it: shut it down so that the
+          // pending receive completes and closes it.
+          flow.sending = false;
+          if (flow.fd >= 0) {
+            shutdown(flow.fd, SHUT_RDWR);
+          }
+          break;
+        }
+        publisher.bytes_sent += result;
+        flow.sent += result;
+        flow.sending = false;
+        if (flow.queued > flow.sent) {
+          URING_REQUIRE(prep_send(index));
+        }
+        break;
+      case CONNECTION_RECV: {
+        if (result <= 0) {
+          close(flow.fd);
+          flow.fd = -1;
+          --open;
+          break;
+        }
+        publisher.bytes_received += result;
+        flow.received += result;
+        const auto now = steady_clock::now();
+        while ((flow.echoed + 1) * flow.message_size <= flow.received) {
+          ++publisher.latency_counts[LatencyBuckets::index(
+              (now - flow.due.front()) / nanoseconds(1))];
+          flow.due.pop_front();
+          ++flow.echoed;
+          URING_REQUIRE(queue_request(index));
+        }
+        publisher.maybe_publish();
+        if (reconnect && flow.echoed >= std::uint64_t(reconnect) &&
+            !flow.sending && flow.received == flow.queued) {
+          URING_REQUIRE(reopen(index));
+          break;
+        }
+        URING_REQUIRE(prep_recv(index));
+        break;
+      }
+      default:
+        std::abort();
+    }
+    if (!io_uring_cq_ready(&ring)) {
+      io_uring_submit(&ring);
+    }
+  }
+  return 0;
+}
+
+struct RawMetrics {
+  std::uint64_t bytes_sent = 0;
+  std::uint64_t short_reads = 0;
+  std::uint64_t short_writes_echo = 0;
+  std::uint64_t short_writes_observer = 0;
+  std::uint64_t short_writes_pipe = 0;
+  std::chrono::steady_clock::duration cpu_user =
+      std::chrono::steady_clock::duration();
+  std::chrono::steady_clock::duration cpu_system =
+      std::chrono::steady_clock::duration();
+  std::uint64_t page_faults_minor = 0;
+  std::uint64_t page_faults_major = 0;
+  std::uint64_t yields = 0;
+  std::uint64_t preempts = 0;
+  // See `ShardCounters`.
+  std::uint64_t spliced_bytes_sent = 0;
+  std::uint64_t strategy_switches = 0;
+  std::uint64_t spliced_connections = 0;
+  std::uint64_t accepts = 0;
+  std::uint64_t closes = 0;
+  // The following are summed over all forked clients.
+  std::uint64_t client_bytes_sent = 0;
+  std::uint64_t client_bytes_received = 0;
+  std::chrono::steady_clock::duration client_cpu_user =
+      std::chrono::steady_clock::duration();
+  std::chrono::steady_clock::duration client_cpu_system =
+      std::chrono::steady_clock::duration();
+  LatencyCounts client_latency_counts = {};
+  std::uint64_t client_verified_bytes = 0;
+  std::uint64_t client_verify_errors = 0;
+};
+
+struct Snapshot : public RawMetrics {
+  std::chrono::steady_clock::time_point when;
+};
+
+struct Metrics : public RawMetrics {
+  Snapshot snapshot;
+};
+
+int get_resource_usage(RawMetrics &raw) {
+  rusage usage = {};
+  POSIX_REQUIRE(getrusage(RUSAGE_SELF, &usage));
+
+  using namespace std::chrono;
+  raw.cpu_user =
+      seconds(usage.ru_utime.tv_sec) + microseconds(usage.ru_utime.tv_usec);
+  raw.cpu_system =
+      seconds(usage.ru_stime.tv_sec) + microseconds(usage.ru_stime.tv_usec);
+  raw.page_faults_minor = usage.ru_minflt;
+  raw.page_faults_major = usage.ru_majflt;
+  raw.yields = usage.ru_nvcsw;
+  raw.preempts = usage.ru_nivcsw;
+
+  return 0;
+}
+
+// Sum the most recently published counters of all `clients` into `raw`.
+void get_client_usage(RawMetrics &raw,
+                      std::span<const ClientCounters> clients) {
+  using namespace std::chrono;
+  raw.client_bytes_sent = 0;
+  raw.client_bytes_received = 0;
+  raw.client_cpu_user = raw.client_cpu_system = steady_clock::duration();
+  raw.client_verified_bytes = raw.client_verify_errors = 0;
+  for (const ClientCounters &client : clients) {
+    raw.client_verified_bytes +=
+        client.verified_bytes.load(std::memory_order_relaxed);
+    raw.client_verify_errors +=
+        client.verify_errors.load(std::memory_order_relaxed);
+    raw.client_bytes_sent += client.bytes_sent.load(std::memory_order_relaxed);
+    raw.client_bytes_received +=
+        client.bytes_received.load(std::memory_order_relaxed);
+    raw.client_cpu_user += microseconds(
+        client.cpu_user_microseconds.load(std::memory_order_relaxed));
+    raw.client_cpu_system += microseconds(
+        client.cpu_system_microseconds.load(std::memory_order_relaxed));
+  }
+  for (std::size_t i = 0; i < LatencyBuckets::count; ++i) {
+    raw.client_latency_counts[i] = 0;
+    for (const ClientCounters &client : clients) {
+      raw.client_latency_counts[i] +=
+          client.latency_counts[i].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+// Counters of one of the threads or worker processes of `server_connections`.
+// Each is the only writer of its `ShardCounters`, which live in a `MAP_SHARED`
+// mapping, until the acceptor restarts it, and the thread that owns the
+// `Monitor` sums them into its `Metrics` (see `get_shard_usage`).
+struct alignas(64) ShardCounters {
+  std::atomic<std::uint64_t> bytes_sent = 0;
+  std::atomic<std::uint64_t> short_reads = 0;
+  std::atomic<std::uint64_t> short_writes_echo = 0;
+  // In hybrid mode, bytes sent with `splice()`, connections switched between
+  // strategies, and connections currently using `splice()`.
+  std::atomic<std::uint64_t> spliced_bytes_sent = 0;
+  std::atomic<std::uint64_t> strategy_switches = 0;
+  std::atomic<std::uint64_t> spliced_connections = 0;
+  // Echo connections accepted, and closed after the peer closed them.
+  std::atomic<std::uint64_t> accepts = 0;
+  std::atomic<std::uint64_t> closes = 0;
+  // The CPU time of a worker or relay process and of those that it replaced,
+  // which the resource usage of the server's process does not include.
+  std::atomic<std::uint64_t> cpu_user_microseconds = 0;
+  std::atomic<std::uint64_t> cpu_system_microseconds = 0;
+};
+
+// Add the CPU time published by the processes of `shards` to that set in `raw`
+// by `get_resource_usage`.
+void add_published_cpu(RawMetrics &raw,
+                       std::span<const ShardCounters> shards) {
+  using namespace std::chrono;
+  for (const ShardCounters &shard : shards) {
+    raw.cpu_user += microseconds(
+        shard.cpu_user_microseconds.load(std::memory_order_relaxed));
+    raw.cpu_system += microseconds(
+        shard.cpu_system_microseconds.load(std::memory_order_relaxed));
+  }
+}
+
+// Set the server's byte, short I/O, strategy and connection counts in `raw` to
+// the sums of those of all `shards`, and add the CPU time of their worker
+// processes to that set by `get_resource_usage`.
+void get_shard_usage(RawMetrics &raw, std::span<const ShardCounters> shards) {
+  raw.bytes_sent = raw.short_reads = raw.short_writes_echo = 0;
+  raw.spliced_bytes_sent = raw.strategy_switches = raw.spliced_connections = 0;
+  raw.accepts = raw.closes = 0;
+  for (const ShardCounters &shard : shards) {
+    raw.bytes_sent += shard.bytes_sent.load(std::memory_order_relaxed);
+    raw.short_reads += shard.short_reads.load(std::memory_order_relaxed);
+    raw.short_writes_echo +=
+        shard.short_writes_echo.load(std::memory_order_relaxed);
+    raw.spliced_bytes_sent +=
+        shard.spliced_bytes_sent.load(std::memory_order_relaxed);
+    raw.strategy_switches +=
+        shard.strategy_switches.load(std::memory_order_relaxed);
+    raw.spliced_connections +=
+        shard.spliced_connections.load(std::memory_order_relaxed);
+    raw.accepts += shard.accepts.load(std::memory_order_relaxed);
+    raw.closes += shard.closes.load(std::memory_order_relaxed);
+  }
+  add_published_cpu(raw, shards);
+}
+
+/* man(7) documentation relevant to the above:
+
+       ru_utime
+              This is the total amount of time spent executing in user
+              mode, expressed in a timeval structure (seconds plus
+              microseconds).
+
+       ru_stime
+              This is the total amount of time spent executing in kernel
+              mode, expressed in a timeval structure (seconds plus
+              microseconds).
+
+       ru_minflt
+              The number of page faults serviced without any I/O
+              activity; here I/O activity is avoided by “reclaiming” a
+              page frame from the list of pages awaiting reallocation.
+
+       ru_majflt
+              The number of page faults serviced that required I/O
+              activity.
+
+       ru_nvcsw (since Linux 2.6)
+              The number of times a context switch resulted due to a
+              process voluntarily giving up the processor before its time
+              slice was completed (usually to await availability of a
+              resource).
+
+       ru_nivcsw (since Linux 2.6)
+              The number of times a context switch resulted due to a
+              higher priority process becoming runnable or because the
+              current process exceeded its time slice.
+*/
+
+// A named, typed value in a log record. `unit` is what follows the value in
+// the tab-separated text format, while `name` is the key used by the
+// structured formats.
+struct Field {
+  std::string name;
+  std::string unit;
+  std::variant<std::int64_t, double, std::string> value;
+};
+
+std::vector<Field> snapshot_diff(std::chrono::steady_clock::time_point start,
+                                 std::chrono::steady_clock::time_point now,
+                                 const Metrics &metrics) {
+  using namespace std::chrono;
+
+  const auto diff = [&](const auto &mem_ptr) {
+    return (metrics.*mem_ptr - metrics.snapshot.*mem_ptr);
+  };
+  const auto scaled_diff = [&](const auto &mem_ptr) -> std::int64_t {
+    return diff(mem_ptr) * seconds(1) / (now - metrics.snapshot.when);
+  };
+  const auto millis = [&](const auto &mem_ptr) -> std::int64_t {
+    return diff(mem_ptr) / milliseconds(1);
+  };
+
+  // CPU time spent by the server and the clients together, per gigabyte
+  // forwarded by the server. Clients publish only every
+  // `ClientPublisher::interval`, so this is noisier than the server's figures.
+  const auto total_cpu = diff(&RawMetrics::cpu_user) +
+                         diff(&RawMetrics::cpu_system) +
+                         diff(&RawMetrics::client_cpu_user) +
+                         diff(&RawMetrics::client_cpu_system);
+  const std::uint64_t bytes = diff(&RawMetrics::bytes_sent);
+  const std::int64_t total_cpu_per_gb =
+      bytes ? total_cpu / microseconds(1) * 1'000'000 / bytes : 0;
+
+  // Note: The "cpu" fields are NOT per second (at least not necessarily).
+  return {
+      {"elapsed_milliseconds", "milliseconds",
+       (now - start) / milliseconds(1)},
+      {"sent_MB_per_second", "MB/s",
+       scaled_diff(&RawMetrics::bytes_sent) / 1'000'000},
+      {"short_reads_per_second", "short_reads/s",
+       scaled_diff(&RawMetrics::short_reads)},
+      {"short_writes_echo_per_second", "short_writes_echo/s",
+       scaled_diff(&RawMetrics::short_writes_echo)},
+      {"short_writes_observer_per_second", "short_writes_observer/s",
+       scaled_diff(&RawMetrics::short_writes_observer)},
+      {"short_writes_pipe_per_second", "short_writes_pipe/s",
+       scaled_diff(&RawMetrics::short_writes_pipe)},
+      {"cpu_user_milliseconds", "cpu_user_milliseconds",
+       millis(&RawMetrics::cpu_user)},
+      {"cpu_system_milliseconds", "cpu_system_milliseconds",
+       millis(&RawMetrics::cpu_system)},
+      {"minor_page_faults_per_second", "minor_page_faults/s",
+       scaled_diff(&RawMetrics::page_faults_minor)},
+      {"major_page_faults_per_second", "major_page_faults/s",
+       scaled_diff(&RawMetrics::page_faults_major)},
+      {"yields_per_second", "yields/s", scaled_diff(&RawMetrics::yields)},
+      {"preempts_per_second", "preempts/s",
+       scaled_diff(&RawMetrics::preempts)},
+      {"client_sent_MB_per_second", "client_sent_MB/s",
+       scaled_diff(&RawMetrics::client_bytes_sent) / 1'000'000},
+      {"client_received_MB_per_second", "client_received_MB/s",
+       scaled_diff(&RawMetrics::client_bytes_received) / 1'000'000},
+      {"client_cpu_user_milliseconds", "client_cpu_user_milliseconds",
+       millis(&RawMetrics::client_cpu_user)},
+      {"client_cpu_system_milliseconds", "client_cpu_system_milliseconds",
+       millis(&RawMetrics::client_cpu_system)},
+      {"total_cpu_milliseconds_per_GB", "total_cpu_milliseconds_per_GB",
+       total_cpu_per_gb},
+  };
+}
+
+// A socket whose queue depths, and for TCP whose `TCP_INFO`, are sampled with
+// each log line.
+struct WatchedSocket {
+  std::string name;
+  int fd = -1;
+  bool tcp = false;
+  // `tcpi_total_retrans` as of the previous sample.
+  std::uint32_t total_retransmits = 0;
+};
+
+// Append to `fields` the current state of the specified `socket`: the bytes
+// waiting in its receive queue and in its send queue (for Unix sockets, the
+// bytes sent but not yet read by the peer), and for TCP the smoothed round
+// trip time, congestion window, retransmissions since the previous sample and
+// delivery rate. Return zero on success or `-errno` if an error occurs.
+int sample_socket(WatchedSocket &socket, std::vector<Field> &fields) {
+  int inq, outq;
+  POSIX_REQUIRE(ioctl(socket.fd, SIOCINQ, &inq));
+  POSIX_REQUIRE(ioctl(socket.fd, SIOCOUTQ, &outq));
+  fields.push_back({socket.name + "_inq_bytes", socket.name + "_inq_bytes",
+                    std::int64_t(inq)});
+  fields.push_back({socket.name + "_outq_bytes", socket.name + "_outq_bytes",
+                    std::int64_t(outq)});
+  if (!socket.tcp) {
+    return 0;
+  }
+
+  tcp_info info = {};
+  socklen_t len = sizeof info;
+  POSIX_REQUIRE(getsockopt(socket.fd, IPPROTO_TCP, TCP_INFO, &info, &len));
+  const std::uint32_t retransmits =
+      info.tcpi_total_retrans - socket.total_retransmits;
+  socket.total_retransmits = info.tcpi_total_retrans;
+  const auto field = [&](std::string_view suffix, std::int64_t value) {
+    std::string name = socket.name;
+    name += suffix;
+    fields.push_back({name, name, value});
+  };
+  field("_rtt_microseconds", info.tcpi_rtt);
+  field("_cwnd_segments", info.tcpi_snd_cwnd);
+  field("_retransmits", retransmits);
+  field("_delivery_rate_MB_per_second", info.tcpi_delivery_rate / 1'000'000);
+  return 0;
+}
+
+// Write `value` to `out` as a CSV cell, quoting only if necessary.
+void csv_quote(std::ostream &out, std::string_view value) {
+  if (value.find_first_of(",\"\n") == std::string_view::npos) {
+    out << value;
+    return;
+  }
+  out << '"';
+  for (const char ch : value) {
+    if (ch == '"') {
+      out << '"';
+    }
+    out << ch;
+  }
+  out << '"';
+}
+
+enum class Format { TEXT, JSONL, CSV };
+
+// Write `fields` to `out` as one record in the specified `format`, followed by
+// a newline. `type` distinguishes the records of a JSONL stream. Values that
+// are not finite are written as null in JSONL and left empty in CSV.
+void write_record(std::ostream &out, Format format, std::string_view type,
+                  std::span<const Field> fields) {
+  const auto write_value = [&](const Field &field) {
+    std::visit(
+        [&](const auto &value) {
+          if constexpr (std::is_same_v<decltype(value), const std::string &>) {
+            if (format == Format::JSONL) {
+              json_quote(out, value);
+            } else if (format == Format::CSV) {
+              csv_quote(out, value);
+            } else {
+              out << value;
+            }
+          } else if constexpr (std::is_same_v<decltype(value),
+                                              const double &>) {
+            // JSON has no infinity or NaN, e.g. of a rate over no time.
+            if (std::isfinite(value) || format == Format::TEXT) {
+              out << value;
+            } else if (format == Format::JSONL) {
+              out << "null";
+            }
+          } else {
+            out << value;
+          }
+        },
+        field.value);
+  };
+
+  const char *separator = "";
+  switch (format) {
+    case Format::TEXT:
+      for (const Field &field : fields) {
+        out << separator;
+        write_value(field);
+        out << ' ' << field.unit;
+        separator = "\t";
+      }
+      break;
+    case Format::JSONL:
+      out << "{\"type\":";
+      json_quote(out, type);
+      for (const Field &field : fields) {
+        out << ',';
+        json_quote(out, field.name);
+        out << ':';
+        write_value(field);
+      }
+      out << '}';
+      break;
+    case Format::CSV:
+      for (const Field &field : fields) {
+        out << separator;
+        write_value(field);
+        separator = ",";
+      }
+      break;
+  }
+  out << '\n';
+}
+
+// Describes a run of the server, for the header of the structured log formats.
+struct RunInfo {
+  std::string mode;
+  std::string family;
+  int pages = 0;
+  int bufsize = 0;
+  std::string ring_profile = "default";
+  unsigned ring_flags = 0;
+  // Samples taken during the first `warmup` are not logged.
+  std::chrono::seconds warmup = std::chrono::seconds(0);
+  // If nonzero, the run ends `duration` after the end of the warm-up.
+  std::chrono::seconds duration = std::chrono::seconds(0);
+  // If nonzero, the run also ends once at least `min_duration` has passed
+  // after the warm-up and the 95% confidence interval of the mean throughput
+  // is within plus or minus `steady_state_percent` of the mean.
+  double steady_state_percent = 0;
+  std::chrono::seconds min_duration = std::chrono::seconds(10);
+  // If nonzero, the echo client is open-loop (see `client_open_loop`),
+  // offering this many MB per second in messages of `message_size` bytes.
+  double rate = 0;
+  int message_size = 0;
+  // Profile of the sizes of the echo client's writes and of the server's
+  // reads (see `SizeDistribution`).
+  std::string sizes = "fixed";
+  // Number of echo connections, served by `server_connections` if more than
+  // one.
+  int connections = 1;
+  // Number of threads serving the echo connections, and of client processes
+  // sharing them, if there is more than one connection.
+  int threads = 1;
+  // If nonzero, each echo connection sends a message only when fewer than
+  // `depth` of its messages await their echo (request/response).
+  int depth = 0;
+  // Whether the clients send and check a pattern (see `pattern_step`).
+  bool verify = false;
+  // Whether the server chooses the size of its reads, up to `pages`, at run
+  // time (see `SizeTuner`).
+  bool tune = false;
+  // In hybrid mode, the mean read size in bytes above which a connection is
+  // switched to `splice()` (see `echo_connections`).
+  int hybrid_threshold = 65536;
+  // If nonzero, each echo connection is replaced by a new one after this many
+  // messages (see `client_connections`).
+  int reconnect = 0;
+  // Whether the connections are served by `threads` worker processes instead
+  // of threads (see `server_connections`).
+  bool processes = false;
+  // If nonzero, the echo connections are forwarded through this many hops,
+  // the server being the first, to a stand-in backend that echoes them (see
+  // `relay_connections`), and whether the hops after the first are threads of
+  // the server rather than processes.
+  int hops = 0;
+  bool hop_threads = false;
+  // Whether the observer is a file rather than a connection (see `Tap`), and
+  // if nonzero, the size at which each of its files is replaced by the next.
+  bool tap = false;
+  std::int64_t tap_size = 0;
+  // Whether the echo client replays a file that a tap captured rather than
+  // sending zeros, and whether at its original timing (see `client_replay`).
+  bool replay = false;
+  bool replay_timing = false;
+};
+
+// Return a '|'-separated list of the names of the `IORING_SETUP_*` bits set in
+// `flags`, or "none".
+std::string ring_flags_names(unsigned flags) {
+  static const std::pair<unsigned, const char *> names[] = {
+      {IORING_SETUP_IOPOLL, "IOPOLL"},
+      {IORING_SETUP_SQPOLL, "SQPOLL"},
+      {IORING_SETUP_SQ_AFF, "SQ_AFF"},
+      {IORING_SETUP_CQSIZE, "CQSIZE"},
+      {IORING_SETUP_CLAMP, "CLAMP"},
+      {IORING_SETUP_ATTACH_WQ, "ATTACH_WQ"},
+      {IORING_SETUP_R_DISABLED, "R_DISABLED"},
+      {IORING_SETUP_SUBMIT_ALL, "SUBMIT_ALL"},
+      {IORING_SETUP_COOP_TASKRUN, "COOP_TASKRUN"},
+      {IORING_SETUP_TASKRUN_FLAG, "TASKRUN_FLAG"},
+      {IORING_SETUP_SQE128, "SQE128"},
+      {IORING_SETUP_CQE32, "CQE32"},
+      {IORING_SETUP_SINGLE_ISSUER, "SINGLE_ISSUER"},
+      {IORING_SETUP_DEFER_TASKRUN, "DEFER_TASKRUN"},
+  };
+  std::string result;
+  for (const auto &[bit, name] : names) {
+    if (flags & bit) {
+      if (!result.empty()) {
+        result += '|';
+      }
+      result += name;
+      flags &= ~bit;
+    }
+  }
+  if (flags) {
+    if (!result.empty()) {
+      result += '|';
+    }
+    result += std::to_string(flags);
+  }
+  return result.empty() ? "none" : result;
+}
+
+// Return the `io_uring` setup flags of the ring profile having the specified
+// `name`, or return null if there is no such profile.
+std::optional<unsigned> ring_profile_flags(std::string_view name) {
+  if (name == "default") {
+    return 0;
+  } else if (name == "sqpoll") {
+    return IORING_SETUP_SQPOLL;
+  } else if (name == "coop") {
+    return IORING_SETUP_COOP_TASKRUN;
+  } else if (name == "defer") {
+    return IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  }
+  return std::nullopt;
+}
+
+// Return the CPUs on which this process may run, as a list of ranges such as
+// "0-3,6".
+std::string cpu_affinity() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof set, &set)) {
+    return "unknown";
+  }
+  std::string result;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &set)) {
+      continue;
+    }
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set)) {
+      ++last;
+    }
+    if (!result.empty()) {
+      result += ',';
+    }
+    result += std::to_string(cpu);
+    if (last != cpu) {
+      result += '-' + std::to_string(last);
+    }
+    cpu = last;
+  }
+  return result;
+}
+
+std::vector<Field> run_fields(const RunInfo &run) {
+  utsname uts = {};
+  uname(&uts);
+  return {
+      {"mode", "mode", run.mode},
+      {"family", "family", run.family},
+      {"pages", "pages", std::int64_t(run.pages)},
+      {"bufsize", "bytes", std::int64_t(run.bufsize)},
+      {"sizes", "sizes", run.sizes},
+      {"kernel", "kernel", std::string(uts.release)},
+      {"ring_profile", "ring_profile", run.ring_profile},
+      {"ring_flags", "ring_flags", ring_flags_names(run.ring_flags)},
+      {"warmup_seconds", "warmup_seconds", std::int64_t(run.warmup.count())},
+      {"duration_seconds", "duration_seconds",
+       std::int64_t(run.duration.count())},
+      {"steady_state_percent", "steady_state_percent",
+       run.steady_state_percent},
+      {"min_duration_seconds", "min_duration_seconds",
+       std::int64_t(run.min_duration.count())},
+      {"rate_MB_per_second", "rate_MB/s", run.rate},
+      {"message_bytes", "message_bytes", std::int64_t(run.message_size)},
+      {"connections", "connections", std::int64_t(run.connections)},
+      {"threads", "threads", std::int64_t(run.threads)},
+      {"depth", "depth", std::int64_t(run.depth)},
+      {"verify", "verify", std::int64_t(run.verify)},
+      {"tune", "tune", std::int64_t(run.tune)},
+      {"hybrid_threshold", "hybrid_threshold_bytes",
+       std::int64_t(run.hybrid_threshold)},
+      {"reconnect", "reconnect_messages", std::int64_t(run.reconnect)},
+      {"processes", "processes", std::int64_t(run.processes)},
+      {"hops", "hops", std::int64_t(run.hops)},
+      {"hop_threads", "hop_threads", std::int64_t(run.hop_threads)},
+      {"tap", "tap", std::int64_t(run.tap)},
+      {"tap_size", "tap_size_bytes", run.tap_size},
+      {"replay", "replay", std::int64_t(run.replay)},
+      {"replay_timing", "replay_timing", std::int64_t(run.replay_timing)},
+      {"cpu_affinity", "cpu_affinity", cpu_affinity()},
+      {"cpu", "cpu", std::int64_t(sched_getcpu())},
+      {"pid", "pid", std::int64_t(getpid())},
+  };
+}
+
+// Counts of observations falling into buckets with the specified inclusive
+// upper bounds, plus an implicit final bucket for everything larger.
+class Histogram {
+  std::vector<double> bounds;
+  std::vector<std::uint64_t> counts;
+  double sum = 0;
+
+ public:
+  explicit Histogram(std::vector<double> bounds)
+      : bounds(std::move(bounds)), counts(this->bounds.size() + 1) {}
+
+  // Return bounds 1, 2, 4, ..., `2^(buckets - 1)`.
+  static std::vector<double> powers_of_two(int buckets) {
+    std::vector<double> result;
+    for (int i = 0; i < buckets; ++i) {
+      result.push_back(double(std::uint64_t(1) << i));
+    }
+    return result;
+  }
+
+  void record(double value) {
+    const auto found = std::lower_bound(bounds.begin(), bounds.end(), value);
+    ++counts[found - bounds.begin()];
+    sum += value;
+  }
+
+  // Write this histogram to `out` in the Prometheus text exposition format,
+  // using the specified metric `name` and `help` text.
+  void expose(std::ostream &out, std::string_view name,
+              std::string_view help) const {
+    out << "# HELP " << name << ' ' << help << "\n# TYPE " << name
+        << " histogram\n";
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i < bounds.size(); ++i) {
+      cumulative += counts[i];
+      out << name << "_bucket{le=\"" << bounds[i] << "\"} " << cumulative
+          << '\n';
+    }
+    cumulative += counts.back();
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << '\n'
+        << name << "_sum " << sum << '\n'
+        << name << "_count " << cumulative << '\n';
+  }
+};
+
+// Serves a text exposition of metrics to clients of a Unix domain socket,
+// using the same `io_uring` as the forwarding loop. A client connects, sends a
+// request (anything, or an immediate shutdown of its write side), and then
+// reads until the server closes the connection. If the request begins with
+// "GET ", the response is HTTP, so that e.g. `curl --unix-socket` works.
+//
+// All of the operations submitted by `MetricsServer` use
+// `IOEntryContext::METRICS`, so that the forwarding loop can route their
+// completions to `on_completion` (see `Monitor::wait_cqe`).
+class MetricsServer {
+  enum Step { ACCEPT, RECV, SEND, BACKOFF };
+
+  struct Scrape {
+    int fd = -1;
+    std::string request;
+    std::string response;
+    std::size_t sent = 0;
+  };
+
+  std::string path;
+  int listen_fd = -1;
+  // Whether an accept is in flight, or due once a backoff expires.
+  bool accepting = false;
+  std::array<Scrape, 4> scrapes;
+  // How long to wait before accepting again after a failure, e.g. for lack of
+  // file descriptors, rather than failing again at once in a tight loop.
+  __kernel_timespec backoff = {.tv_sec = 0, .tv_nsec = 100'000'000};
+
+  static void set_context(io_uring_sqe *sqe, Step step, int fd, int slot) {
+    ::set_context(sqe, {.op = IOEntryContext::METRICS,
+                        .step = step,
+                        .from_fd = fd,
+                        .connection = std::uint32_t(slot)});
+  }
+
+  int arm_accept(io_uring &ring) {
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+    io_uring_prep_accept(sqe, listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    set_context(sqe, ACCEPT, listen_fd, 0);
+    accepting = true;
+    return 0;
+  }
+
+  int arm_backoff(io_uring &ring) {
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+    io_uring_prep_timeout(sqe, &backoff, 0, 0);
+    set_context(sqe, BACKOFF, -1, 0);
+    accepting = true;
+    return 0;
+  }
+
+  int arm_recv(io_uring &ring, int slot) {
+    Scrape &scrape = scrapes[slot];
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+    scrape.request.resize(1024);
+    io_uring_prep_recv(sqe, scrape.fd, scrape.request.data(),
+                       scrape.request.size(), 0);
+    set_context(sqe, RECV, scrape.fd, slot);
+    return 0;
+  }
+
+  int arm_send(io_uring &ring, int slot) {
+    Scrape &scrape = scrapes[slot];
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+    io_uring_prep_send(sqe, scrape.fd, scrape.response.data() + scrape.sent,
+                       scrape.response.size() - scrape.sent, MSG_NOSIGNAL);
+    set_context(sqe, SEND, scrape.fd, slot);
+    return 0;
+  }
+
+  // Close the connection in the specified `slot` and, if we were not already
+  // accepting, begin accepting again.
+  int finish(io_uring &ring, int slot) {
+    close(scrapes[slot].fd);
+    scrapes[slot] = Scrape();
+    if (!accepting) {
+      URING_REQUIRE(arm_accept(ring));
+    }
+    return 0;
+  }
+
+ public:
+  MetricsServer() = default;
+  MetricsServer(const MetricsServer &) = delete;
+  MetricsServer &operator=(const MetricsServer &) = delete;
+
+  ~MetricsServer() {
+    for (const Scrape &scrape : scrapes) {
+      if (scrape.fd >= 0) {
+        close(scrape.fd);
+      }
+    }
+    if (listen_fd >= 0) {
+      close(listen_fd);
+      unlink(path.c_str());
+    }
+  }
+
+  bool enabled() const { return listen_fd >= 0; }
+
+  // Listen on a Unix domain socket at the specified `socket_path`, replacing
+  // any existing socket file there. Return zero on success or `-errno` if an
+  // error occurs.
+  int listen(const std::string &socket_path, io_uring &ring) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof addr.sun_path) {
+      std::cerr << "Metrics socket path is too long: " << socket_path << '\n';
+      return -ENAMETOOLONG;
+    }
+    std::copy_n(socket_path.data(), socket_path.size(), addr.sun_path);
+
+    int sock;
+    POSIX_REQUIRE(sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    unlink(socket_path.c_str());
+    POSIX_REQUIRE(bind(sock, (sockaddr *)&addr, sizeof addr));
+    POSIX_REQUIRE(::listen(sock, scrapes.size()));
+    listen_fd = sock;
+    path = socket_path;
+
+    URING_REQUIRE(arm_accept(ring));
+    URING_REQUIRE(io_uring_submit(&ring));
+    return 0;
+  }
+
+  // Advance the scrape to which the specified completion belongs. Call
+  // `render` to produce the body of a response. Return zero on success or
+  // `-errno` if an error occurs that prevents serving further scrapes.
+  // Failures of individual scrapes are not errors.
+  template <typename Render>
+  int on_completion(io_uring &ring, IOEntryContext io_ctx, int result,
+                    const Render &render) {
+    const int slot = io_ctx.connection;
+    switch (io_ctx.step) {
+      case ACCEPT: {
+        accepting = false;
+        if (result < 0) {
+          std::cerr << "Unable to accept metrics connection: "
+                    << std::strerror(-result) << '\n';
+          URING_REQUIRE(arm_backoff(ring));
+          break;
+        }
+        const auto free = std::find_if(
+            scrapes.begin(), scrapes.end(),
+            [](const Scrape &scrape) { return scrape.fd < 0; });
+        free->fd = result;
+        URING_REQUIRE(arm_recv(ring, free - scrapes.begin()));
+        if (std::any_of(scrapes.begin(), scrapes.end(),
+                        [](const Scrape &scrape) { return scrape.fd < 0; })) {
+          URING_REQUIRE(arm_accept(ring));
+        }
+        break;
+      }
+      case RECV: {
+        if (result < 0) {
+          URING_REQUIRE(finish(ring, slot));
+          break;
+        }
+        Scrape &scrape = scrapes[slot];
+        scrape.request.resize(result);
+        const std::string body = render();
+        if (scrape.request.starts_with("GET ")) {
+          scrape.response =
+              "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Connection: close\r\n"
+              "Content-Length: " +
+              std::to_string(body.size()) + "\r\n\r\n" + body;
+        } else {
+          scrape.response = body;
+        }
+        URING_REQUIRE(arm_send(ring, slot));
+        break;
+      }
+      case BACKOFF:
+        URING_REQUIRE(arm_accept(ring));
+        break;
+      case SEND: {
+        Scrape &scrape = scrapes[slot];
+        if (result > 0) {
+          scrape.sent += result;
+        }
+        if (result <= 0 || scrape.sent == scrape.response.size()) {
+          URING_REQUIRE(finish(ring, slot));
+        } else {
+          URING_REQUIRE(arm_send(ring, slot));
+        }
+        break;
+      }
+    }
+    URING_REQUIRE(io_uring_submit(&ring));
+    return 0;
+  }
+};
+
+// Estimates how precisely the mean of a series of throughput samples is known,
+// in order to end a run once more samples would not change the result much.
+// Consecutive samples of a steady process are positively correlated, which
+// makes the naive confidence interval too narrow, so the interval is computed
+// from an effective sample size that accounts for lag-1 autocorrelation.
+class SteadyState {
+  std::vector<double> samples;
+
+  // Return the 97.5th percentile of Student's t distribution with the
+  // specified degrees of freedom `df`.
+  static double t_975(double df) {
+    static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447,
+                                   2.365,  2.306, 2.262, 2.228, 2.201, 2.179,
+                                   2.160,  2.145, 2.131, 2.120, 2.110, 2.101,
+                                   2.093,  2.086, 2.080, 2.074, 2.069, 2.064,
+                                   2.060,  2.056, 2.052, 2.048, 2.045, 2.042};
+    if (df < 1) {
+      return std::numeric_limits<double>::infinity();
+    }
+    if (df <= std::size(table)) {
+      return table[int(df) - 1];
+    }
+    // Cornish-Fisher expansion about the normal quantile.
+    const double z = 1.959964;
+    return z + (z * z * z + z) / (4 * df) +
+           (5 * std::pow(z, 5) + 16 * z * z * z + 3 * z) / (96 * df * df);
+  }
+
+ public:
+  void add(double sample) { samples.push_back(sample); }
+
+  std::size_t count() const { return samples.size(); }
+
+  double mean() const {
+    double sum = 0;
+    for (const double sample : samples) {
+      sum += sample;
+    }
+    return samples.empty() ? 0 : sum / samples.size();
+  }
+
+  // Return the half-width of the 95% confidence interval of the mean, or
+  // infinity if there are too few samples to tell.
+  double half_width() const {
+    const std::size_t n = samples.size();
+    if (n < 3) {
+      return std::numeric_limits<double>::infinity();
+    }
+    const double m = mean();
+    double variance = 0, covariance = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      variance += (samples[i] - m) * (samples[i] - m);
+      if (i) {
+        covariance += (samples[i] - m) * (samples[i - 1] - m);
+      }
+    }
+    if (variance == 0) {
+      return 0;
+    }
+    const double r1 = std::clamp(covariance / variance, 0.0, 0.99);
+    const double effective_n = std::max(2.0, n * (1 - r1) / (1 + r1));
+    const double sd = std::sqrt(variance / (n - 1));
+    return t_975(effective_n - 1) * sd / std::sqrt(effective_n);
+  }
+};
+
+// Samples `metrics` once per `interval` and logs the difference from the
+// previous sample, as text to standard output and in the configured `Format`
+// to the log file. The structured formats begin with a description of the run.
+// Samples taken during the run's warm-up are printed but not logged. Once the
+// run's duration has elapsed, or the mean throughput has reached the requested
+// precision (see `SteadyState`), `finished()` returns true. When the monitor
+// is destroyed, it logs a summary of the throughput samples. Optionally, also
+// serves the current totals and histograms over a Unix domain socket; see
+// `MetricsServer`.
+class Monitor {
+  const std::chrono::steady_clock::duration interval = std::chrono::seconds(1);
+  const std::chrono::steady_clock::time_point start;
+  const std::chrono::steady_clock::time_point warmup_end;
+  const std::chrono::steady_clock::time_point end;
+  const std::chrono::steady_clock::time_point min_end;
+  const double steady_state_fraction;
+  bool done = false;
+  bool converged = false;
+  SteadyState throughput;
+  const bool measures_latency;
+  const bool verify;
+  const bool hybrid;
+  const bool reconnects;
+  const int hops;
+  // Latency counts as of the end of the warm-up, and when that was.
+  LatencyCounts warmup_latency_counts = {};
+  std::chrono::steady_clock::time_point warmup_latency_when;
+  const std::span<const ClientCounters> clients;
+  // Set by `count_shards` if several threads serve the echo connections.
+  std::span<const ShardCounters> shards;
+  // Set by `count_relays` if hops after the first forward the connections.
+  std::span<const ShardCounters> relays;
+  // Set by `watch_tuner` if the server tunes the size of its reads.
+  const SizeTuner *tuner = nullptr;
+  const Format format;
+  const std::vector<Field> run;
+  std::ofstream log;
+  bool csv_header_written = false;
+  MetricsServer metrics_server;
+  std::vector<WatchedSocket> sockets;
+  Histogram interval_throughput{{100, 250, 500, 750, 1000, 1250, 1500, 1750,
+                                 2000, 2250, 2500, 3000, 3500, 4000, 5000,
+                                 7500, 10000}};
+
+  // Return the Prometheus text exposition of the current totals and
+  // histograms.
+  std::string render_metrics() const {
+    using namespace std::chrono;
+    RawMetrics now = metrics;
+    get_resource_usage(now);
+    add_published_cpu(now, relays);
+    get_client_usage(now, clients);
+    if (!shards.empty()) {
+      get_shard_usage(now, shards);
+    }
+
+    std::ostringstream out;
+    out << "# HELP echo_server_run_info Description of this run.\n"
+           "# TYPE echo_server_run_info gauge\n"
+           "echo_server_run_info{";
+    const char *separator = "";
+    for (const Field &field : run) {
+      out << separator << field.name << '=';
+      std::visit(
+          [&](const auto &value) {
+            std::ostringstream text;
+            text << value;
+            json_quote(out, text.str());
+          },
+          field.value);
+      separator = ",";
+    }
+    out << "} 1\n";
+
+    const auto expose = [&](std::string_view name, std::string_view type,
+                            std::string_view help, auto value) {
+      out << "# HELP echo_server_" << name << ' ' << help
+          << "\n# TYPE echo_server_" << name << ' ' << type
+          << "\necho_server_" << name << ' ' << value << '\n';
+    };
+    const auto seconds = [](steady_clock::duration elapsed) {
+      return duration<double>(elapsed).count();
+    };
+    expose("uptime_seconds", "gauge", "Time since the server started.",
+           seconds(steady_clock::now() - start));
+    expose("sent_bytes_total", "counter",
+           "Bytes sent to the echo and observer connections.", now.bytes_sent);
+    expose("short_reads_total", "counter",
+           "Reads that returned less than was requested.", now.short_reads);
+    expose("short_writes_echo_total", "counter",
+           "Short writes to the echo connection.", now.short_writes_echo);
+    expose("short_writes_observer_total", "counter",
+           "Short writes to the observer connection.",
+           now.short_writes_observer);
+    expose("short_writes_pipe_total", "counter",
+           "Short tee()s into the observer's pipe.", now.short_writes_pipe);
+    expose("cpu_user_seconds_total", "counter",
+           "CPU time spent by the server in user mode.",
+           seconds(now.cpu_user));
+    expose("cpu_system_seconds_total", "counter",
+           "CPU time spent by the server in kernel mode.",
+           seconds(now.cpu_system));
+    expose("minor_page_faults_total", "counter",
+           "Page faults serviced without I/O.", now.page_faults_minor);
+    expose("major_page_faults_total", "counter",
+           "Page faults serviced with I/O.", now.page_faults_major);
+    expose("yields_total", "counter", "Voluntary context switches.",
+           now.yields);
+    expose("preempts_total", "counter", "Involuntary context switches.",
+           now.preempts);
+    if (!shards.empty()) {
+      expose("accepts_total", "counter", "Echo connections accepted.",
+             now.accepts);
+      expose("open_connections", "gauge", "Echo connections open.",
+             now.accepts - now.closes);
+    }
+    expose("client_sent_bytes_total", "counter",
+           "Bytes sent by the forked clients.", now.client_bytes_sent);
+    expose("client_received_bytes_total", "counter",
+           "Bytes received by the forked clients.", now.client_bytes_received);
+    expose("client_cpu_user_seconds_total", "counter",
+           "CPU time spent by the forked clients in user mode.",
+           seconds(now.client_cpu_user));
+    expose("client_cpu_system_seconds_total", "counter",
+           "CPU time spent by the forked clients in kernel mode.",
+           seconds(now.client_cpu_system));
+    read_sizes.expose(out, "echo_server_read_size_bytes",
+                      "Bytes returned by each read from the echo connection.");
+    interval_throughput.expose(
+        out, "echo_server_interval_throughput_megabytes_per_second",
+        "Output throughput of each logging interval.");
+    return out.str();
+  }
+
+ public:
+  Metrics metrics;
+  Histogram read_sizes{Histogram::powers_of_two(24)};
+
+  Monitor(const RunInfo &run, Format format, const std::string &log_path,
+          std::span<const ClientCounters> clients)
+      : start(std::chrono::steady_clock::now()),
+        warmup_end(start + run.warmup),
+        end(run.duration.count()
+                ? warmup_end + run.duration
+                : std::chrono::steady_clock::time_point::max()),
+        min_end(warmup_end + run.min_duration),
+        steady_state_fraction(run.steady_state_percent / 100),
+        measures_latency(run.rate > 0 || run.connections > 1 || run.depth ||
+                         run.mode == "hybrid" || run.reconnect),
+        verify(run.verify),
+        hybrid(run.mode == "hybrid"),
+        reconnects(run.reconnect > 0),
+        hops(run.hops),
+        warmup_latency_when(start),
+        clients(clients),
+        format(format),
+        run(run_fields(run)),
+        log(log_path) {
+    metrics.snapshot.when = start;
+    if (format == Format::JSONL) {
+      write_record(log, format, "run", this->run);
+      log << std::flush;
+    }
+  }
+
+  // Append the count and percentiles of the latencies counted in `now` but not
+  // in `before` to `fields`.
+  static void add_latency_fields(const LatencyCounts &now,
+                                 const LatencyCounts &before,
+                                 std::chrono::steady_clock::duration elapsed,
+                                 std::vector<Field> &fields) {
+    LatencyCounts counts;
+    std::int64_t total = 0;
+    std::size_t highest = 0;
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+      counts[i] = now[i] - before[i];
+      total += counts[i];
+      if (counts[i]) {
+        highest = i;
+      }
+    }
+    const auto microseconds = [&](double fraction) {
+      return LatencyBuckets::quantile(counts, fraction) / 1000;
+    };
+    fields.push_back({"messages", "messages", total});
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    fields.push_back({"messages_per_second", "messages/s",
+                      seconds > 0 ? total / seconds : 0.0});
+    fields.push_back(
+        {"latency_p50_microseconds", "p50_microseconds", microseconds(0.5)});
+    fields.push_back(
+        {"latency_p90_microseconds", "p90_microseconds", microseconds(0.9)});
+    fields.push_back(
+        {"latency_p99_microseconds", "p99_microseconds", microseconds(0.99)});
+    fields.push_back({"latency_p999_microseconds", "p99.9_microseconds",
+                      microseconds(0.999)});
+    fields.push_back({"latency_max_microseconds", "max_microseconds",
+                      total ? LatencyBuckets::midpoint(highest) / 1000 : 0.0});
+  }
+
+  ~Monitor() {
+    const double half_width = throughput.half_width();
+    std::vector<Field> summary = {
+        {"samples", "samples", std::int64_t(throughput.count())},
+        {"mean_MB_per_second", "MB/s", throughput.mean()},
+        {"ci95_half_width_MB_per_second", "MB/s",
+         std::isfinite(half_width) ? half_width : -1.0},
+        {"converged", "converged", std::int64_t(converged)},
+    };
+    if (measures_latency) {
+      add_latency_fields(metrics.client_latency_counts, warmup_latency_counts,
+                         metrics.snapshot.when - warmup_latency_when, summary);
+    }
+    if (verify) {
+      summary.push_back({"verify_errors", "verify_errors",
+                         std::int64_t(metrics.client_verify_errors)});
+    }
+    if (tuner) {
+      summary.push_back(
+          {"tuned_pages", "tuned_pages", std::int64_t(tuner->best_pages())});
+      summary.push_back({"tuner_converged", "tuner_converged",
+                         std::int64_t(tuner->has_converged())});
+    }
+    std::cerr << "summary: ";
+    write_record(std::cerr, Format::TEXT, "summary", summary);
+    if (format == Format::JSONL) {
+      write_record(log, format, "summary", summary);
+    }
+  }
+
+  // If at least `interval` has elapsed since the previous sample, take a new
+  // sample and log it. Return zero on success or `-errno` if an error occurs.
+  int poll() {
+    const auto now = std::chrono::steady_clock::now();
+    if (now - metrics.snapshot.when < interval) {
+      return 0;
+    }
+
+    URING_REQUIRE(get_resource_usage(metrics));
+    add_published_cpu(metrics, relays);
+    get_client_usage(metrics, clients);
+    if (!shards.empty()) {
+      get_shard_usage(metrics, shards);
+    }
+    std::vector<Field> sample = snapshot_diff(start, now, metrics);
+    if (measures_latency) {
+      add_latency_fields(metrics.client_latency_counts,
+                         metrics.snapshot.client_latency_counts,
+                         now - metrics.snapshot.when, sample);
+    }
+    if (verify) {
+      const double seconds =
+          std::chrono::duration<double>(now - metrics.snapshot.when).count();
+      sample.push_back(
+          {"client_verified_MB_per_second", "client_verified_MB/s",
+           std::int64_t((metrics.client_verified_bytes -
+                         metrics.snapshot.client_verified_bytes) /
+                        seconds / 1'000'000)});
+      sample.push_back({"client_verify_errors", "client_verify_errors",
+                        std::int64_t(metrics.client_verify_errors -
+                                     metrics.snapshot.client_verify_errors)});
+    }
+    if (hybrid) {
+      const double seconds =
+          std::chrono::duration<double>(now - metrics.snapshot.when).count();
+      sample.push_back(
+          {"spliced_MB_per_second", "spliced_MB/s",
+           std::int64_t((metrics.spliced_bytes_sent -
+                         metrics.snapshot.spliced_bytes_sent) /
+                        seconds / 1'000'000)});
+      sample.push_back({"strategy_switches_per_second", "strategy_switches/s",
+                        std::int64_t((metrics.strategy_switches -
+                                      metrics.snapshot.strategy_switches) /
+                                     seconds)});
+      sample.push_back({"spliced_connections", "spliced_connections",
+                        std::int64_t(metrics.spliced_connections)});
+    }
+    if (reconnects) {
+      const double seconds =
+          std::chrono::duration<double>(now - metrics.snapshot.when).count();
+      sample.push_back(
+          {"accepts_per_second", "accepts/s",
+           std::int64_t((metrics.accepts - metrics.snapshot.accepts) /
+                        seconds)});
+      sample.push_back({"open_connections", "open_connections",
+                        std::int64_t(metrics.accepts - metrics.closes)});
+    }
+    if (hops) {
+      // The CPU time of all hops, but not of the backend, per gigabyte that
+      // each of them forwards, i.e. that the server sends both ways, and per
+      // hop.
+      using namespace std::chrono;
+      const std::uint64_t bytes =
+          metrics.bytes_sent - metrics.snapshot.bytes_sent;
+      const auto cpu = metrics.cpu_user - metrics.snapshot.cpu_user +
+                       metrics.cpu_system - metrics.snapshot.cpu_system;
+      const std::int64_t per_hop =
+          bytes ? cpu / microseconds(1) * 1'000'000 / bytes / hops : 0;
+      sample.push_back({"cpu_milliseconds_per_GB_per_hop",
+                        "cpu_milliseconds_per_GB_per_hop", per_hop});
+    }
+    if (tuner) {
+      sample.push_back({"read_pages", "read_pages",
+                        std::int64_t(tuner->current_pages())});
+      sample.push_back(
+          {"tuned_pages", "tuned_pages", std::int64_t(tuner->best_pages())});
+      sample.push_back({"tuner_converged", "tuner_converged",
+                        std::int64_t(tuner->has_converged())});
+    }
+    for (WatchedSocket &socket : sockets) {
+      URING_REQUIRE(sample_socket(socket, sample));
+    }
+
+    write_record(std::cout, Format::TEXT, "sample", sample);
+    std::cout << std::flush;
+    done = now >= end;
+    if (metrics.snapshot.when < warmup_end) {
+      metrics.snapshot.when = now;
+      static_cast<RawMetrics &>(metrics.snapshot) = metrics;
+      warmup_latency_counts = metrics.client_latency_counts;
+      warmup_latency_when = now;
+      return 0;
+    }
+
+    const double megabytes_per_second =
+        (metrics.bytes_sent - metrics.snapshot.bytes_sent) /
+        std::chrono::duration<double>(now - metrics.snapshot.when).count() /
+        1'000'000;
+    interval_throughput.record(megabytes_per_second);
+    throughput.add(megabytes_per_second);
+    if (steady_state_fraction > 0 && now >= min_end &&
+        throughput.half_width() <=
+            steady_state_fraction * throughput.mean()) {
+      done = converged = true;
+    }
+    switch (format) {
+      case Format::TEXT:
+      case Format::JSONL:
+        write_record(log, format, "sample", sample);
+        break;
+      case Format::CSV: {
+        // Each row carries the run description, so that rows from many runs
+        // can be concatenated.
+        std::vector<Field> row = run;
+        row.insert(row.end(), sample.begin(), sample.end());
+        if (!csv_header_written) {
+          const char *separator = "";
+          for (const Field &field : row) {
+            log << separator << field.name;
+            separator = ",";
+          }
+          log << '\n';
+          csv_header_written = true;
+        }
+        write_record(log, format, "sample", row);
+      }
+    }
+    log << std::flush;
+
+    metrics.snapshot.when = now;
+    static_cast<RawMetrics &>(metrics.snapshot) = metrics;
+    return 0;
+  }
+
+  // Return whether the run's duration, if any, has elapsed.
+  bool finished() const { return done; }
+
+  // Include the sizes chosen by the specified `tuner` in each log line.
+  void watch_tuner(const SizeTuner &tuner) { this->tuner = &tuner; }
+
+  // Take the server's byte and short I/O counts from the specified `shards`
+  // instead of from `metrics`.
+  void count_shards(std::span<const ShardCounters> shards) {
+    this->shards = shards;
+  }
+
+  // Include the CPU time published by the specified `relays` in the server's.
+  void count_relays(std::span<const ShardCounters> relays) {
+    this->relays = relays;
+  }
+
+  // Include the queue depths and, for TCP, the `TCP_INFO` of the socket `fd`
+  // in each log line, naming the fields after the specified `name`. Return
+  // zero on success or `-errno` if an error occurs.
+  int watch(std::string name, int fd) {
+    int domain;
+    socklen_t len = sizeof domain;
+    POSIX_REQUIRE(getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len));
+    WatchedSocket &socket = sockets.emplace_back();
+    socket.name = std::move(name);
+    socket.fd = fd;
+    socket.tcp = domain == AF_INET || domain == AF_INET6;
+    return 0;
+  }
+
+  // Serve metrics on a Unix domain socket at the specified `path`, using the
+  // specified `ring`. Return zero on success or `-errno` if an error occurs.
+  int serve_metrics(const std::string &path, io_uring &ring) {
+    return metrics_server.listen(path, ring);
+  }
+
+  // Handle, without waiting, the completions of the metrics server that are
+  // at the head of the completion queue of the specified `ring`, for loops
+  // that otherwise block outside the ring, e.g. in `recv()`. Return zero on
+  // success or a negative error code if an error occurs.
+  int serve_pending_metrics(io_uring &ring) {
+    io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+      const std::optional<IOEntryContext> io_ctx =
+          op_table().find(io_uring_cqe_get_data64(cqe));
+      if (io_ctx && io_ctx->op != IOEntryContext::METRICS) {
+        return 0;
+      }
+      if (!io_ctx) {
+        // Stale.
+        io_uring_cqe_seen(&ring, cqe);
+        continue;
+      }
+      trace(TRACE_CQE, *io_ctx, cqe->flags, cqe->res);
+      take_context(cqe);
+      const int result = cqe->res;
+      io_uring_cqe_seen(&ring, cqe);
+      URING_REQUIRE(metrics_server.on_completion(
+          ring, *io_ctx, result, [&]() { return render_metrics(); }));
+    }
+    return 0;
+  }
+
+  // Wait for a completion on the specified `ring` that is not stale and does
+  // not belong to the metrics server, and load it into the specified `cqe`
+  // (see `wait_fresh_cqe`). Completions that do belong to the metrics server
+  // are handled and marked seen. Return zero on success or a negative error
+  // code if an error occurs.
+  int wait_cqe(io_uring &ring, io_uring_cqe **cqe) {
+    for (;;) {
+      URING_REQUIRE(wait_fresh_cqe(ring, cqe));
+      if (op_table().find(io_uring_cqe_get_data64(*cqe))->op !=
+          IOEntryContext::METRICS) {
+        return 0;
+      }
+      const IOEntryContext io_ctx = take_context(*cqe).value();
+      const int result = (*cqe)->res;
+      io_uring_cqe_seen(&ring, *cqe);
+      URING_REQUIRE(metrics_server.on_completion(
+          ring, io_ctx, result, [&]() { return render_metrics(); }));
+    }
+  }
+};
+
+// A file into which the observer's pipe is spliced instead of into an
+// observer connection, preallocated and, if it has a size limit, replaced by
+// the next of "<path>.0", "<path>.1", ... once full. Each file has an index,
+// e.g. "<path>.0.index", with a line for each write: its `CLOCK_MONOTONIC`
+// time in nanoseconds and its size, from which `client_replay` can send the
+// file at its original timing.
+class Tap {
+  std::string path;
+  std::int64_t max_bytes = 0;
+  int files = 0;
+  int fd_ = -1;
+  std::int64_t offset_ = 0;
+  // The current file's index, and its lines not yet written there, which are
+  // written in batches so that most writes to the tap cost no system call.
+  int index_fd = -1;
+  std::string index_lines;
+
+  static constexpr std::size_t index_batch = 64 * 1024;
+
+  // Write out the lines of the index held back so far. Return zero on
+  // success or `-errno` if an error occurs.
+  int flush_index() {
+    for (std::size_t done = 0; done < index_lines.size();) {
+      ssize_t written;
+      POSIX_REQUIRE(written = write(index_fd, index_lines.data() + done,
+                                    index_lines.size() - done));
+      done += written;
+    }
+    index_lines.clear();
+    return 0;
+  }
+
+  // Close the current file, if any, and open the next. Return zero on
+  // success or `-errno` if an error occurs.
+  int rotate() {
+    if (fd_ >= 0) {
+      // Start writing the full file back without waiting for it.
+      POSIX_REQUIRE(sync_file_range(fd_, 0, 0, SYNC_FILE_RANGE_WRITE));
+      POSIX_REQUIRE(close(fd_));
+      URING_REQUIRE(flush_index());
+      POSIX_REQUIRE(close(index_fd));
+    }
+    const std::string name =
+        max_bytes ? path + '.' + std::to_string(files++) : path;
+    POSIX_REQUIRE(fd_ = open(name.c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    offset_ = 0;
+    POSIX_REQUIRE(index_fd = open((name + ".index").c_str(),
+                                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                  0644));
+    if (max_bytes) {
+      // Allocate the blocks up front so that writes need not, but leave the
+      // size to grow with what is written.
+      POSIX_REQUIRE(fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, max_bytes));
+    }
+    return 0;
+  }
+
+ public:
+  ~Tap() {
+    if (fd_ >= 0) {
+      fdatasync(fd_);
+      close(fd_);
+      flush_index();
+      close(index_fd);
+    }
+  }
+
+  // Open the file at the specified `path`, or with a nonzero `max_bytes`
+  // "<path>.0", which is replaced once it holds `max_bytes`. Return zero on
+  // success or `-errno` if an error occurs.
+  int open_file(std::string path, std::int64_t max_bytes) {
+    this->path = std::move(path);
+    this->max_bytes = max_bytes;
+    return rotate();
+  }
+
+  int fd() const { return fd_; }
+
+  // The offset at which to write next, as `io_uring_prep` expects it.
+  char *offset() { return reinterpret_cast<char *>(&offset_); }
+
+  // Return how many of the specified `bytes` fit into the current file,
+  // first replacing it if it is full, or return `-errno` if an error occurs.
+  int room(int bytes) {
+    if (max_bytes && offset_ >= max_bytes) {
+      URING_REQUIRE(rotate());
+    }
+    return max_bytes ? std::min<std::int64_t>(bytes, max_bytes - offset_)
+                     : bytes;
+  }
+
+  // Note that the specified number of `bytes` was written just now. Return
+  // zero on success or `-errno` if an error occurs.
+  int wrote(int bytes) {
+    offset_ += bytes;
+    index_lines +=
+        std::to_string(
+            std::chrono::steady_clock::now().time_since_epoch().count()) +
+        ' ' + std::to_string(bytes) + '\n';
+    return index_lines.size() < index_batch ? 0 : flush_index();
+  }
+};
+
+// Consume from `conn1fd` and duplicate all data onto `connfd1` and `connfd2`,
+// or instead of `connfd2` into `tap` if it is not null.
+// Use `splice()` and `tee()`, involving the pipes `pipe1fds` and `pipe2fds`,
+// to prevent any copies of data into user space. Request as many bytes per
+// `splice()` as `sizes` says, or as `tuner` says if it is not null. Record
+// progress in `monitor`.
+int server_splicetee(io_uring &ring, int conn1fd, int conn2fd,
+                     int (&pipe1fds)[2], int (&pipe2fds)[2],
+                     SizeDistribution sizes, SizeTuner *tuner, Tap *tap,
+                     Monitor &monitor) {
+  Metrics &metrics = monitor.metrics;
+
+  while (!monitor.finished()) {
+    URING_REQUIRE(monitor.poll());
+    ++Tracer::chunk;
+    const int splice_size = tuner ? tuner->size() : sizes.next();
+
+    io_uring_sqe *sqe;
+    io_uring_cqe *cqe;
+    IOEntryContext io_ctx;
+
+    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+    io_ctx.op = IOEntryContext::SPLICE;
+    io_ctx.bytes_desired = splice_size;
+    io_ctx.from_fd = conn1fd;
+    io_ctx.to_fd = pipe1fds[1];
+    io_uring_prep(sqe, io_ctx);
+    sqe->flags |= IOSQE_IO_HARDLINK;
+
+    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+    io_ctx.op = IOEntryContext::TEE;
+    io_ctx.bytes_desired = splice_size;
+    io_ctx.from_fd = pipe1fds[0];
+    io_ctx.to_fd = pipe2fds[1];
+    io_uring_prep(sqe, io_ctx);
+
+    // std::cerr << "Submitting two chained operations to io_uring.\n";
+    io_uring_submit(&ring);
+
+    int bytes_to_send;
+
+    for (int i = 0; i < 2; i++) {
+      // std::cerr << "Waiting for a completion from io_uring.\n";
+      URING_REQUIRE(monitor.wait_cqe(ring, &cqe));
+      URING_REQUIRE(cqe->res);
+      const int result = cqe->res;
+      io_ctx = take_context(cqe).value();
+      io_uring_cqe_seen(&ring, cqe);
+      if (io_ctx.op == IOEntryContext::SPLICE) {
+        monitor.read_sizes.record(result);
+        if (tuner) {
+          tuner->record(io_ctx.bytes_desired, result);
+        }
+      }
+      if (result < io_ctx.bytes_desired) {
+        switch (io_ctx.op) {
+          case IOEntryContext::SPLICE:
+            ++metrics.short_reads;
+            break;
+          case IOEntryContext::TEE:
+            ++metrics.short_writes_pipe;
+            break;
+          default:
+            break;
+        }
+      }
+      if (io_ctx.op == IOEntryContext::SPLICE && io_ctx.from_fd == conn1fd &&
+          result == 0) {
+        std::cerr << "Nothing more to read.\n";
+        return 0;
+      }
+      if (i == 0) {
+        bytes_to_send = result;
+      } else {
+        // TODO: Can we tee() less than we splice()? Maybe if conn2 is slow?
+        bytes_to_send = std::min(bytes_to_send, result);
+      }
+    }
+
+    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+    io_ctx.op = IOEntryContext::SPLICE;
     io_ctx.bytes_desired = bytes_to_send;
     io_ctx.from_fd = pipe1fds[0];
     io_ctx.to_fd = conn1fd;
@@ -468,18 +3583,182 @@ int server_splicetee(int bufsize, io_uring &ring, int conn1fd, int conn2fd,
     io_ctx.bytes_desired = bytes_to_send;
     io_ctx.from_fd = pipe2fds[0];
     io_ctx.to_fd = conn2fd;
-    io_uring_prep(sqe, io_ctx);
+    // What remains to be written into the tap, which may take several
+    // splices if its file fills up.
+    int tap_remaining = bytes_to_send;
+    if (tap) {
+      URING_REQUIRE(io_ctx.bytes_desired = tap->room(tap_remaining));
+      io_ctx.to_fd = tap->fd();
+    }
+    io_uring_prep(sqe, io_ctx, 0, tap ? tap->offset() : nullptr);
 
     // std::cerr << "Submitting two unchained operations to io_uring.\n";
     io_uring_submit(&ring);
 
     for (int j = 0; j < 2; j++) {
       // std::cerr << "Waiting for a completion from io_uring.\n";
-      URING_REQUIRE(io_uring_wait_cqe(&ring, &cqe));
+      URING_REQUIRE(monitor.wait_cqe(ring, &cqe));
+      // TODO: handle EINTR
+      URING_REQUIRE(cqe->res);
+      const int result = cqe->res;
+      io_ctx = take_context(cqe).value();
+      io_uring_cqe_seen(&ring, cqe);
+      metrics.bytes_sent += result;
+      if (tap && io_ctx.to_fd == tap->fd()) {
+        URING_REQUIRE(tap->wrote(result));
+        tap_remaining -= result;
+        if (tap_remaining) {
+          PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+          URING_REQUIRE(io_ctx.bytes_desired = tap->room(tap_remaining));
+          io_ctx.to_fd = tap->fd();
+          io_uring_prep(sqe, io_ctx, 0, tap->offset());
+          io_uring_submit(&ring);
+          --j;
+        }
+        continue;
+      }
+      if (result < io_ctx.bytes_desired) {
+        // TODO: This should only happen on account of a signal.
+        if (io_ctx.to_fd == conn1fd) {
+          ++metrics.short_writes_echo;
+        } else if (io_ctx.to_fd == conn2fd) {
+          ++metrics.short_writes_observer;
+        }
+        io_ctx.bytes_desired -= result;
+        PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+        io_uring_prep(sqe, io_ctx);
+        io_uring_submit(&ring);
+        --j;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Consume from the shared-memory ring `echo_in` and duplicate all data onto
+// the rings `echo_out` and `observer` (see `ShmRing`), copying it from one to
+// the others. Take as many bytes at a time as `sizes` says, or as `tuner`
+// says if it is not null. Stop once the echo client has hung up the
+// connection `conn1fd`, which carries no data. Record progress in `monitor`.
+int server_shm(int conn1fd, ShmRing &echo_in, ShmRing &echo_out,
+               ShmRing &observer, SizeDistribution sizes, SizeTuner *tuner,
+               Monitor &monitor) {
+  Metrics &metrics = monitor.metrics;
+
+  while (!monitor.finished()) {
+    URING_REQUIRE(monitor.poll());
+    ++Tracer::chunk;
+
+    const int read_size = tuner ? tuner->size() : sizes.next();
+    const std::span<const char> in = echo_in.readable();
+    const std::span<char> out = echo_out.writable();
+    const std::span<char> copy = observer.writable();
+    const std::size_t bytes =
+        std::min({in.size(), std::size_t(read_size), out.size(), copy.size()});
+    if (!bytes) {
+      // Wait for whichever of the rings holds the others up.
+      int fds[3];
+      std::size_t count = 0;
+      if (in.empty()) {
+        fds[count++] = echo_in.wait_readable();
+      }
+      if (out.empty()) {
+        fds[count++] = echo_out.wait_writable();
+      }
+      if (copy.empty()) {
+        fds[count++] = observer.wait_writable();
+      }
+      int hung_up;
+      URING_REQUIRE(hung_up = wait_shm({fds, count}, conn1fd, 100));
+      if (hung_up) {
+        std::cerr << "Nothing more to read.\n";
+        return 0;
+      }
+      continue;
+    }
+    monitor.read_sizes.record(bytes);
+    if (tuner) {
+      tuner->record(read_size, bytes);
+    }
+    if (bytes < std::size_t(read_size)) {
+      ++metrics.short_reads;
+    }
+    std::memcpy(out.data(), in.data(), bytes);
+    std::memcpy(copy.data(), in.data(), bytes);
+    echo_out.commit(bytes);
+    observer.commit(bytes);
+    echo_in.consume(bytes);
+    metrics.bytes_sent += 2 * bytes;
+  }
+
+  return 0;
+}
+
+// Consume from `conn1fd` and duplicate all data onto `connfd1` and `connfd2`.
+// Use `recv()` and `send()` with a buffer in user space. Request as many bytes
+// per `recv()` as `sizes` says, or as `tuner` says if it is not null, in
+// which case the largest size is `bufsize`. Record progress in `monitor`.
+int server_recvsend(io_uring &ring, int conn1fd, int conn2fd, int bufsize,
+                    SizeDistribution sizes, SizeTuner *tuner,
+                    Monitor &monitor) {
+  Metrics &metrics = monitor.metrics;
+  std::vector<char> buffer(tuner ? std::max(bufsize, sizes.max())
+                                 : sizes.max());
+
+  while (!monitor.finished()) {
+    URING_REQUIRE(monitor.poll());
+    // Nothing else is in flight here, and `recv()` blocks outside the ring.
+    URING_REQUIRE(monitor.serve_pending_metrics(ring));
+    ++Tracer::chunk;
+
+    const int read_size = tuner ? tuner->size() : sizes.next();
+    int bytes_to_send = recv(conn1fd, buffer.data(), read_size, 0);
+    trace(TRACE_SYSCALL,
+          {.bytes_desired = read_size,
+           .op = IOEntryContext::RECV,
+           .from_fd = conn1fd,
+           .to_fd = 0},
+          0, bytes_to_send < 0 ? -errno : bytes_to_send);
+    POSIX_REQUIRE(bytes_to_send);
+    if (bytes_to_send == 0) {
+      std::cerr << "Nothing more to read.\n";
+      return 0;
+    }
+    monitor.read_sizes.record(bytes_to_send);
+    if (tuner) {
+      tuner->record(read_size, bytes_to_send);
+    }
+    if (bytes_to_send < read_size) {
+      ++metrics.short_reads;
+    }
+
+    io_uring_sqe *sqe;
+    io_uring_cqe *cqe;
+    IOEntryContext io_ctx;
+
+    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+    io_ctx.op = IOEntryContext::SEND;
+    io_ctx.bytes_desired = bytes_to_send;
+    io_ctx.to_fd = conn1fd;
+    io_uring_prep(sqe, io_ctx, 0, buffer.data());
+
+    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+    io_ctx.op = IOEntryContext::SEND;
+    io_ctx.bytes_desired = bytes_to_send;
+    io_ctx.to_fd = conn2fd;
+    io_uring_prep(sqe, io_ctx, 0, buffer.data());
+
+    // std::cerr << "Submitting two unchained send() operations to io_uring.\n";
+    io_uring_submit(&ring);
+
+    for (int j = 0; j < 2; j++) {
+      // std::cerr << "Waiting for a completion from io_uring. j=" << j << '\n';
+      URING_REQUIRE(monitor.wait_cqe(ring, &cqe));
       // TODO: handle EINTR
       URING_REQUIRE(cqe->res);
       const int result = cqe->res;
-      io_ctx = std::bit_cast<IOEntryContext>(io_uring_cqe_get_data64(cqe));
+      io_ctx = take_context(cqe).value();
       io_uring_cqe_seen(&ring, cqe);
       metrics.bytes_sent += result;
       if (result < io_ctx.bytes_desired) {
@@ -489,111 +3768,1097 @@ int server_splicetee(int bufsize, io_uring &ring, int conn1fd, int conn2fd,
         } else if (io_ctx.to_fd == conn2fd) {
           ++metrics.short_writes_observer;
         }
-        io_ctx.bytes_desired -= result;
-        PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
-        io_uring_prep(sqe, io_ctx);
-        io_uring_submit(&ring);
-        --j;
+        io_ctx.bytes_desired -= result;
+        PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
+        io_uring_prep(sqe, io_ctx, 0, buffer.data() + result);
+        io_uring_submit(&ring);
+        --j;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Send the connection `fd` over the Unix socket `channel` as `SCM_RIGHTS`,
+// with one byte of data, and close it here. Return zero on success or
+// `-errno` if an error occurs, in which case `fd` is left open.
+int send_connection(int channel, int fd) {
+  char byte = 0;
+  iovec data = {&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof fd)] = {};
+  msghdr message = {};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof control;
+  cmsghdr *const rights = CMSG_FIRSTHDR(&message);
+  rights->cmsg_level = SOL_SOCKET;
+  rights->cmsg_type = SCM_RIGHTS;
+  rights->cmsg_len = CMSG_LEN(sizeof fd);
+  std::memcpy(CMSG_DATA(rights), &fd, sizeof fd);
+  if (sendmsg(channel, &message, MSG_NOSIGNAL) == -1) {
+    return -errno;
+  }
+  close(fd);
+  return 0;
+}
+
+// Return the connection received as `SCM_RIGHTS` in `message`, or -1 if there
+// is none.
+int received_connection(msghdr &message) {
+  const cmsghdr *const rights = CMSG_FIRSTHDR(&message);
+  if (!rights || rights->cmsg_level != SOL_SOCKET ||
+      rights->cmsg_type != SCM_RIGHTS) {
+    return -1;
+  }
+  int fd;
+  std::memcpy(&fd, CMSG_DATA(rights), sizeof fd);
+  return fd;
+}
+
+// What the threads or worker processes of `server_connections` share. Shard
+// 0 is the thread that accepts the connections. In process mode it serves
+// none, and each other shard is a worker process, to which it sends
+// connections over a Unix socket of its own (see `send_connection`).
+struct Shards {
+  // Each shard's counters, and the file descriptor of its ring if it is a
+  // thread, or -1.
+  std::span<ShardCounters> counters;
+  std::vector<int> rings;
+  // In the acceptor, the Unix socket to each worker process, and its process
+  // ID; in a worker, the Unix socket from the acceptor. -1 if there is none.
+  std::vector<int> channels;
+  std::vector<pid_t> workers;
+  // Fork the worker process of the specified shard, setting its channel and
+  // process ID. Return zero on success or `-errno` if an error occurs.
+  std::function<int(int)> start_worker;
+  // In proxy mode, the listening socket of the next hop or of the backend, to
+  // whose address each connection is forwarded. -1 otherwise.
+  int upstream_listener = -1;
+  // Whether the shard using this is a process of its own, which publishes its
+  // CPU time in its counters.
+  bool own_process = false;
+  std::atomic<bool> stop = false;
+
+  explicit Shards(std::span<ShardCounters> counters)
+      : counters(counters),
+        rings(counters.size(), -1),
+        channels(counters.size(), -1),
+        workers(counters.size(), -1) {}
+};
+
+// Create the pipe `fds` to splice a connection through. Return zero on success
+// or `-errno` if an error occurs, including `-ENOBUFS` if the kernel gave the
+// pipe less than its default capacity of 16 pages, which it does once the
+// user's pipes exceed /proc/sys/fs/pipe-user-pages-soft, e.g. with thousands
+// of connections, and which would skew the measurements.
+int open_splice_pipe(std::array<int, 2> &fds) {
+  POSIX_REQUIRE(pipe(fds.data()));
+  int capacity;
+  POSIX_REQUIRE(capacity = fcntl(fds[0], F_GETPIPE_SZ));
+  if (capacity < 16 * sysconf(_SC_PAGESIZE)) {
+    std::cerr << "A pipe has only " << capacity
+              << " bytes; raise /proc/sys/fs/pipe-user-pages-soft or use "
+                 "fewer connections.\n";
+    close(fds[0]);
+    close(fds[1]);
+    fds = {-1, -1};
+    return -ENOBUFS;
+  }
+  return 0;
+}
+
+// Echo everything received on each echo connection back to it, serving all of
+// them from `ring` as shard `shard` of `shards`: first `fds`, then those that
+// the thread accepts from `listen_fd`, unless it is -1, or that another thread
+// or the acceptor process hands to it. If `use_pipes` is false, use `recv()`
+// and `send()` with a buffer of `bufsize` bytes per connection. Otherwise,
+// `splice()` from each connection into a pipe of its own and back out, or, if
+// `hybrid_threshold` is nonzero, start each connection with `recv()` and
+// `send()` and switch it to `splice()` while its reads return at least
+// `hybrid_threshold` bytes on average. If `shards.upstream_listener` is not
+// -1, proxy each connection instead: connect it to the backend on the ring,
+// then `splice()` what each side sends to the other through a pipe per
+// direction, passing on a shutdown of either direction and closing both
+// connections once both directions are shut down. A thread that accepts
+// connections does so with a multishot accept, and hands each to the shard
+// with the fewest open, restarting any worker process that has exited. A
+// connection that the peer has closed is closed on the ring, and its slot,
+// with its buffer and pipes, serves the next connection. If `monitor` is null,
+// return once `shards.stop` is set or the acceptor hangs up; otherwise, poll
+// `monitor` and return once it is finished or once no connection has been
+// open at two ticks in a row.
+int echo_connections(int bufsize, io_uring &ring, int listen_fd,
+                     std::span<const int> fds, bool use_pipes,
+                     int hybrid_threshold, Shards &shards, int shard,
+                     Monitor *monitor) {
+  // Reads of a connection between reconsiderations of its strategy.
+  constexpr int hybrid_window = 16;
+
+  struct Echo {
+    // The connection, or -1 if the slot is free.
+    int fd = -1;
+    std::array<int, 2> pipe = {-1, -1};
+    std::vector<char> buffer;
+    // Bytes received but not yet sent back, starting at `offset`.
+    int pending = 0;
+    int offset = 0;
+    // Whether the connection is served with `splice()`.
+    bool spliced = false;
+    // Reads since the strategy was last considered, and the bytes they
+    // returned.
+    int window_reads = 0;
+    std::uint64_t window_bytes = 0;
+    // Changed when the connection is done with, so that any completions of
+    // its operations that arrive later are ignored.
+    std::uint32_t generation = 0;
+    // In proxy mode, the connection to the next hop, on which nothing is
+    // forwarded until it is connected, the pipe or buffer of what it sends,
+    // and the bytes of that not yet sent on, starting at `return_offset`,
+    // while `pipe`, `buffer` and `pending` are what the client sends. Also,
+    // whether each has shut down its sending side.
+    int upstream = -1;
+    std::array<int, 2> return_pipe = {-1, -1};
+    std::vector<char> return_buffer;
+    int returning = 0;
+    int return_offset = 0;
+    bool client_done = false;
+    bool upstream_done = false;
+  };
+
+  const auto count = [](std::atomic<std::uint64_t> &counter,
+                        std::uint64_t amount) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount,
+                  std::memory_order_relaxed);
+  };
+  ShardCounters &counters = shards.counters[shard];
+  // Slots stay in place as more are added, since operations in flight refer
+  // to their buffers.
+  std::deque<Echo> echoes;
+  std::vector<std::uint32_t> free_slots;
+  bool accepting = false;
+  // Connections given to each shard by this one, if it accepts them.
+  std::vector<std::uint64_t> handed(shards.counters.size());
+  // Consecutive ticks at which no connection was open, if `monitor` is set.
+  int idle_ticks = 0;
+  __kernel_timespec wakeup = {};
+  // In a worker process, the message in which the acceptor sends each
+  // connection, and whether the acceptor has hung up. In a process of its
+  // own, the CPU time of the processes that this one replaced.
+  const int channel = shards.channels[shard];
+  char handoff_byte;
+  iovec handoff_data = {&handoff_byte, 1};
+  alignas(cmsghdr) char handoff_control[CMSG_SPACE(sizeof(int))];
+  msghdr handoff = {};
+  bool hung_up = false;
+  // In proxy mode, where each connection is forwarded to.
+  sockaddr_storage upstream_address = {};
+  socklen_t upstream_length = sizeof upstream_address;
+  if (shards.upstream_listener >= 0) {
+    POSIX_REQUIRE(getsockname(shards.upstream_listener,
+                              reinterpret_cast<sockaddr *>(&upstream_address),
+                              &upstream_length));
+  }
+  const std::uint64_t cpu_user_base =
+      counters.cpu_user_microseconds.load(std::memory_order_relaxed);
+  const std::uint64_t cpu_system_base =
+      counters.cpu_system_microseconds.load(std::memory_order_relaxed);
+
+  // Switch the connection of `echo`, which has nothing pending, to `splice()`
+  // if its latest reads were large, since moving large amounts through a pipe
+  // costs less CPU per byte than copying them through the buffer, and back to
+  // `recv()` and `send()` if they were small, with some hysteresis. Short
+  // reads count with the bytes they returned.
+  const auto reconsider = [&](Echo &echo) {
+    if (!hybrid_threshold || echo.window_reads < hybrid_window) {
+      return;
+    }
+    const std::uint64_t mean = echo.window_bytes / echo.window_reads;
+    echo.window_reads = 0;
+    echo.window_bytes = 0;
+    const bool spliced =
+        mean >= std::uint64_t(echo.spliced ? hybrid_threshold / 2
+                                           : hybrid_threshold);
+    if (spliced == echo.spliced) {
+      return;
+    }
+    echo.spliced = spliced;
+    count(counters.strategy_switches, 1);
+    count(counters.spliced_connections, spliced ? 1 : -1);
+  };
+  const auto prep_in = [&](std::uint32_t index) {
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    Echo &echo = echoes[index];
+    if (echo.spliced) {
+      io_uring_prep(sqe,
+                    {.bytes_desired = bufsize,
+                     .op = IOEntryContext::SPLICE,
+                     .step = CONNECTION_SPLICE_IN,
+                     .from_fd = echo.fd,
+                     .to_fd = echo.pipe[1],
+                     .connection = index,
+                     .generation = echo.generation});
+    } else {
+      echo.buffer.resize(bufsize);
+      io_uring_prep(sqe,
+                    {.bytes_desired = bufsize,
+                     .op = IOEntryContext::RECV,
+                     .step = CONNECTION_RECV,
+                     .from_fd = echo.fd,
+                     .connection = index,
+                     .generation = echo.generation},
+                    0, echo.buffer.data());
+    }
+    return 0;
+  };
+  const auto prep_out = [&](std::uint32_t index) {
+    Echo &echo = echoes[index];
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    if (echo.spliced) {
+      io_uring_prep(sqe, {.bytes_desired = echo.pending,
+                          .op = IOEntryContext::SPLICE,
+                          .step = CONNECTION_SPLICE_OUT,
+                          .from_fd = echo.pipe[0],
+                          .to_fd = echo.upstream >= 0 ? echo.upstream : echo.fd,
+                          .connection = index,
+                          .generation = echo.generation});
+    } else {
+      io_uring_prep(sqe,
+                    {.bytes_desired = echo.pending,
+                     .op = IOEntryContext::SEND,
+                     .step = CONNECTION_SEND,
+                     .to_fd = echo.upstream >= 0 ? echo.upstream : echo.fd,
+                     .connection = index,
+                     .generation = echo.generation},
+                    0, echo.buffer.data() + echo.offset);
+    }
+    return 0;
+  };
+  const auto prep_return_in = [&](std::uint32_t index) {
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    Echo &echo = echoes[index];
+    if (echo.spliced) {
+      io_uring_prep(sqe, {.bytes_desired = bufsize,
+                          .op = IOEntryContext::SPLICE,
+                          .step = CONNECTION_RETURN_IN,
+                          .from_fd = echo.upstream,
+                          .to_fd = echo.return_pipe[1],
+                          .connection = index,
+                          .generation = echo.generation});
+    } else {
+      echo.return_buffer.resize(bufsize);
+      io_uring_prep(sqe,
+                    {.bytes_desired = bufsize,
+                     .op = IOEntryContext::RECV,
+                     .step = CONNECTION_RETURN_IN,
+                     .from_fd = echo.upstream,
+                     .connection = index,
+                     .generation = echo.generation},
+                    0, echo.return_buffer.data());
+    }
+    return 0;
+  };
+  const auto prep_return_out = [&](std::uint32_t index) {
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    Echo &echo = echoes[index];
+    if (echo.spliced) {
+      io_uring_prep(sqe, {.bytes_desired = echo.returning,
+                          .op = IOEntryContext::SPLICE,
+                          .step = CONNECTION_RETURN_OUT,
+                          .from_fd = echo.return_pipe[0],
+                          .to_fd = echo.fd,
+                          .connection = index,
+                          .generation = echo.generation});
+    } else {
+      io_uring_prep(sqe,
+                    {.bytes_desired = echo.returning,
+                     .op = IOEntryContext::SEND,
+                     .step = CONNECTION_RETURN_OUT,
+                     .to_fd = echo.fd,
+                     .connection = index,
+                     .generation = echo.generation},
+                    0, echo.return_buffer.data() + echo.return_offset);
+    }
+    return 0;
+  };
+  // Wake up periodically, so that the monitor is polled even when the
+  // connections are idle.
+  const auto prep_tick = [&]() {
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    to_timespec(
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(100),
+        wakeup);
+    io_uring_prep(sqe,
+                  {.op = IOEntryContext::TIMEOUT, .step = CONNECTION_TICK}, 0,
+                  reinterpret_cast<char *>(&wakeup));
+    return 0;
+  };
+  const auto prep_accept = [&]() {
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    io_uring_prep(sqe, {.op = IOEntryContext::ACCEPT,
+                        .step = CONNECTION_ACCEPT,
+                        .from_fd = listen_fd});
+    accepting = true;
+    return 0;
+  };
+  const auto prep_receive = [&]() {
+    io_uring_sqe *sqe;
+    PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+    handoff = {};
+    handoff.msg_iov = &handoff_data;
+    handoff.msg_iovlen = 1;
+    handoff.msg_control = handoff_control;
+    handoff.msg_controllen = sizeof handoff_control;
+    io_uring_prep(sqe,
+                  {.bytes_desired = 1,
+                   .op = IOEntryContext::RECVMSG,
+                   .step = CONNECTION_HANDOFF,
+                   .from_fd = channel},
+                  0, reinterpret_cast<char *>(&handoff));
+    return 0;
+  };
+  // In a process of its own, publish its CPU time, since the resource usage of
+  // the server's process does not include it.
+  const auto publish_cpu = [&]() {
+    rusage usage = {};
+    POSIX_REQUIRE(getrusage(RUSAGE_SELF, &usage));
+    const auto to_microseconds = [](const timeval &time) {
+      return std::uint64_t(time.tv_sec) * 1'000'000 + time.tv_usec;
+    };
+    counters.cpu_user_microseconds.store(
+        cpu_user_base + to_microseconds(usage.ru_utime),
+        std::memory_order_relaxed);
+    counters.cpu_system_microseconds.store(
+        cpu_system_base + to_microseconds(usage.ru_stime),
+        std::memory_order_relaxed);
+    return 0;
+  };
+  // Begin serving the connection `fd` in a free slot. In proxy mode, first
+  // connect it to the backend on the ring, or, if that cannot begin, close it.
+  const auto add = [&](int fd) {
+    int upstream = -1;
+    if (shards.upstream_listener >= 0) {
+      upstream =
+          socket(upstream_address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (upstream < 0) {
+        const int err = errno;
+        std::cerr << "Unable to connect to the backend: "
+                  << std::strerror(err) << '\n';
+        close(fd);
+        count(counters.accepts, 1);
+        count(counters.closes, 1);
+        return 0;
+      }
+    }
+    std::uint32_t index;
+    if (free_slots.empty()) {
+      index = echoes.size();
+      echoes.emplace_back();
+    } else {
+      index = free_slots.back();
+      free_slots.pop_back();
+    }
+    Echo &echo = echoes[index];
+    if (use_pipes && echo.pipe[0] < 0) {
+      URING_REQUIRE(open_splice_pipe(echo.pipe));
+    }
+    echo.fd = fd;
+    echo.pending = 0;
+    echo.offset = 0;
+    echo.spliced = use_pipes && !hybrid_threshold;
+    echo.window_reads = 0;
+    echo.window_bytes = 0;
+    count(counters.accepts, 1);
+    if (upstream >= 0) {
+      if (use_pipes && echo.return_pipe[0] < 0) {
+        URING_REQUIRE(open_splice_pipe(echo.return_pipe));
+      }
+      echo.upstream = upstream;
+      echo.returning = 0;
+      echo.client_done = false;
+      echo.upstream_done = false;
+      io_uring_sqe *sqe;
+      PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+      io_uring_prep(sqe,
+                    {.bytes_desired = upstream_length,
+                     .op = IOEntryContext::CONNECT,
+                     .step = CONNECTION_CONNECT,
+                     .to_fd = upstream,
+                     .connection = index,
+                     .generation = echo.generation},
+                    0, reinterpret_cast<char *>(&upstream_address));
+      return 0;
+    }
+    return prep_in(index);
+  };
+  // Return the number of connections that this thread has handed to the
+  // specified shard and that the shard has not closed.
+  const auto open_in = [&](std::size_t target) {
+    return handed[target] -
+           shards.counters[target].closes.load(std::memory_order_relaxed);
+  };
+  // Serve the accepted connection `fd` in the shard that has the fewest
+  // connections open, handing it over if that is another thread or a worker
+  // process. If no shard can take it, serve it here.
+  const auto hand_over = [&](int fd) {
+    for (;;) {
+      std::size_t target = shard;
+      std::uint64_t fewest = UINT64_MAX;
+      for (std::size_t i = 0; i < handed.size(); ++i) {
+        if ((shards.rings[i] >= 0 || shards.channels[i] >= 0) &&
+            open_in(i) < fewest) {
+          target = i;
+          fewest = open_in(i);
+        }
+      }
+      ++handed[target];
+      if (target == std::size_t(shard)) {
+        return add(fd);
+      }
+      if (shards.channels[target] < 0) {
+        io_uring_sqe *sqe;
+        PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+        io_uring_prep(sqe, {.op = IOEntryContext::MESSAGE,
+                            .step = CONNECTION_HANDOFF,
+                            .from_fd = fd,
+                            .to_fd = shards.rings[target]});
+        return 0;
       }
+      if (const int rc = send_connection(shards.channels[target], fd)) {
+        // The worker is gone, or going. Hang up on it, so that it exits if
+        // it has not, and try another; it is restarted at the next tick.
+        std::cerr << "Unable to hand over echo connection to worker "
+                  << target << ": " << std::strerror(-rc) << '\n';
+        close(shards.channels[target]);
+        shards.channels[target] = -1;
+        --handed[target];
+        continue;
+      }
+      return 0;
     }
-  }
-
-  return 0;
-}
-
-// Consume from `conn1fd` and duplicate all data onto `connfd1` and `connfd2`.
-// Use `recv()` and `send()` with a buffer in user space.
-int server_recvsend(int bufsize, io_uring &ring, int conn1fd, int conn2fd) {
-  const auto interval = std::chrono::seconds(1);
-  const auto start = std::chrono::steady_clock::now();
-
-  Metrics metrics;
-  metrics.snapshot.when = start;
+  };
+  // Stop serving the connection in slot `index`, close it on the ring, and
+  // free the slot.
+  const auto drop = [&](std::uint32_t index) {
+    Echo &echo = echoes[index];
+    ++echo.generation;
+    // In proxy mode, unless both sides have shut down, operations may still be
+    // in flight on either connection. Shut both down, so that they complete.
+    const bool unfinished =
+        echo.upstream >= 0 && !(echo.client_done && echo.upstream_done);
+    if (unfinished) {
+      shutdown(echo.fd, SHUT_RDWR);
+      shutdown(echo.upstream, SHUT_RDWR);
+    }
+    for (int &fd : {std::ref(echo.fd), std::ref(echo.upstream)}) {
+      if (fd < 0) {
+        continue;
+      }
+      io_uring_sqe *sqe;
+      PTR_REQUIRE(sqe = get_sqe_or_submit(ring));
+      io_uring_prep(sqe, {.op = IOEntryContext::CLOSE,
+                          .step = CONNECTION_CLOSE,
+                          .from_fd = fd,
+                          .connection = index,
+                          .generation = echo.generation});
+      fd = -1;
+    }
+    if (echo.spliced && (echo.pending || unfinished)) {
+      // What is left in the pipe must not reach the next connection.
+      close(echo.pipe[0]);
+      close(echo.pipe[1]);
+      echo.pipe = {-1, -1};
+    }
+    if (unfinished && echo.spliced) {
+      close(echo.return_pipe[0]);
+      close(echo.return_pipe[1]);
+      echo.return_pipe = {-1, -1};
+    }
+    if (hybrid_threshold && echo.spliced) {
+      count(counters.spliced_connections, -1);
+    }
+    free_slots.push_back(index);
+    count(counters.closes, 1);
+    return 0;
+  };
+  // Restart each worker process that has exited, e.g. because it crashed,
+  // counting the connections that it was serving as closed.
+  const auto restart_workers = [&]() {
+    for (std::size_t i = 0; i < shards.workers.size(); ++i) {
+      int status;
+      if (shards.workers[i] < 0 ||
+          waitpid(shards.workers[i], &status, WNOHANG) != shards.workers[i]) {
+        continue;
+      }
+      std::cerr << "Worker " << i << " exited with status " << status
+                << "; restarting it.\n";
+      shards.workers[i] = -1;
+      if (shards.channels[i] >= 0) {
+        close(shards.channels[i]);
+        shards.channels[i] = -1;
+      }
+      ShardCounters &worker = shards.counters[i];
+      const std::uint64_t accepts =
+          worker.accepts.load(std::memory_order_relaxed);
+      worker.closes.store(accepts, std::memory_order_relaxed);
+      worker.spliced_connections.store(0, std::memory_order_relaxed);
+      handed[i] = accepts;
+      // On failure, the other shards serve its share.
+      shards.start_worker(i);
+    }
+  };
 
-  std::ofstream log("log");
-  std::vector<char> buffer(bufsize);
+  for (const int fd : fds) {
+    URING_REQUIRE(hand_over(fd));
+  }
+  if (listen_fd >= 0) {
+    URING_REQUIRE(prep_accept());
+  }
+  if (channel >= 0) {
+    URING_REQUIRE(prep_receive());
+  }
+  URING_REQUIRE(prep_tick());
+  io_uring_submit(&ring);
 
-  for (;;) {
-    const auto now = std::chrono::steady_clock::now();
-    if (now - metrics.snapshot.when >= interval) {
-      URING_REQUIRE(get_resource_usage(metrics));
-      const std::string message = log_snapshot_diff(start, now, metrics);
-      std::cout << message << std::flush;
-      log << message << std::flush;
-      metrics.snapshot.when = now;
-      static_cast<RawMetrics &>(metrics.snapshot) = metrics;
+  io_uring_cqe *cqe;
+  while (idle_ticks < 2 && !hung_up &&
+         (monitor ? !monitor->finished()
+                  : !shards.stop.load(std::memory_order_relaxed))) {
+    if (monitor) {
+      URING_REQUIRE(monitor->poll());
     }
+    ++Tracer::chunk;
 
-    int bytes_to_send = recv(conn1fd, buffer.data(), buffer.size(), 0);
-    POSIX_REQUIRE(bytes_to_send);
-    if (bytes_to_send == 0) {
-      std::cerr << "Nothing more to read.\n";
-      return 0;
+    if (monitor) {
+      URING_REQUIRE(monitor->wait_cqe(ring, &cqe));
+    } else {
+      URING_REQUIRE(wait_fresh_cqe(ring, &cqe));
     }
-    if (std::size_t(bytes_to_send) < buffer.size()) {
-      ++metrics.short_reads;
+    const int result = cqe->res;
+    const bool more = cqe->flags & IORING_CQE_F_MORE;
+    const IOEntryContext io_ctx = take_context(cqe).value();
+    io_uring_cqe_seen(&ring, cqe);
+    const std::uint32_t index = io_ctx.connection;
+    if (io_ctx.step < CONNECTION_TICK &&
+        io_ctx.generation != echoes[index].generation) {
+      continue;
+    }
+    switch (io_ctx.step) {
+      case CONNECTION_TICK:
+        if (monitor) {
+          std::uint64_t open = 0;
+          for (std::size_t i = 0; i < handed.size(); ++i) {
+            open += open_in(i);
+          }
+          idle_ticks = open ? 0 : idle_ticks + 1;
+          restart_workers();
+        }
+        if (shards.own_process) {
+          URING_REQUIRE(publish_cpu());
+        }
+        if (listen_fd >= 0 && !accepting) {
+          URING_REQUIRE(prep_accept());
+        }
+        URING_REQUIRE(prep_tick());
+        break;
+      case CONNECTION_ACCEPT:
+        accepting = more;
+        if (result < 0) {
+          // E.g. because there are too many open files. Try again at the next
+          // tick.
+          std::cerr << "Unable to accept echo connection: "
+                    << std::strerror(-result) << '\n';
+          break;
+        }
+        URING_REQUIRE(hand_over(result));
+        if (!accepting) {
+          URING_REQUIRE(prep_accept());
+        }
+        break;
+      case CONNECTION_HANDOFF:
+        if (io_ctx.op == IOEntryContext::RECVMSG) {
+          // Sent by the acceptor process, which hangs up once it is done.
+          if (result == 0) {
+            hung_up = true;
+            break;
+          }
+          URING_REQUIRE(result);
+          if (const int fd = received_connection(handoff); fd >= 0) {
+            URING_REQUIRE(add(fd));
+          }
+          URING_REQUIRE(prep_receive());
+        } else if (io_ctx.from_fd < 0) {
+          // Handed to this thread.
+          URING_REQUIRE(add(result));
+        } else if (result < 0) {
+          // Could not be handed over, so serve it here.
+          std::cerr << "Unable to hand over echo connection: "
+                    << std::strerror(-result) << '\n';
+          URING_REQUIRE(add(io_ctx.from_fd));
+        }
+        break;
+      case CONNECTION_CLOSE:
+        URING_REQUIRE(result);
+        break;
+      case CONNECTION_RECV:
+      case CONNECTION_SPLICE_IN: {
+        if (result == 0 && echoes[index].upstream >= 0) {
+          // The client is done sending. Tell the backend.
+          Echo &echo = echoes[index];
+          shutdown(echo.upstream, SHUT_WR);
+          echo.client_done = true;
+          if (echo.upstream_done) {
+            URING_REQUIRE(drop(index));
+          }
+          break;
+        }
+        if (result == -ECONNRESET || result == 0) {
+          URING_REQUIRE(drop(index));
+          break;
+        }
+        URING_REQUIRE(result);
+        if (monitor) {
+          monitor->read_sizes.record(result);
+        }
+        if (result < bufsize) {
+          count(counters.short_reads, 1);
+        }
+        Echo &echo = echoes[index];
+        ++echo.window_reads;
+        echo.window_bytes += result;
+        echo.pending = result;
+        echo.offset = 0;
+        URING_REQUIRE(prep_out(index));
+        break;
+      }
+      case CONNECTION_SEND:
+      case CONNECTION_SPLICE_OUT: {
+        if (result == -ECONNRESET || result == -EPIPE) {
+          URING_REQUIRE(drop(index));
+          break;
+        }
+        URING_REQUIRE(result);
+        Echo &echo = echoes[index];
+        count(counters.bytes_sent, result);
+        if (echo.spliced) {
+          count(counters.spliced_bytes_sent, result);
+        }
+        echo.pending -= result;
+        echo.offset += result;
+        if (echo.pending) {
+          count(counters.short_writes_echo, 1);
+          URING_REQUIRE(prep_out(index));
+        } else {
+          reconsider(echo);
+          URING_REQUIRE(prep_in(index));
+        }
+        break;
+      }
+      case CONNECTION_CONNECT:
+        if (result < 0) {
+          std::cerr << "Unable to connect to the backend: "
+                    << std::strerror(-result) << '\n';
+          URING_REQUIRE(drop(index));
+          break;
+        }
+        URING_REQUIRE(prep_return_in(index));
+        URING_REQUIRE(prep_in(index));
+        break;
+      case CONNECTION_RETURN_IN: {
+        Echo &echo = echoes[index];
+        if (result == 0) {
+          // The backend is done sending. Tell the client.
+          shutdown(echo.fd, SHUT_WR);
+          echo.upstream_done = true;
+          if (echo.client_done) {
+            URING_REQUIRE(drop(index));
+          }
+          break;
+        }
+        if (result == -ECONNRESET) {
+          URING_REQUIRE(drop(index));
+          break;
+        }
+        URING_REQUIRE(result);
+        echo.returning = result;
+        echo.return_offset = 0;
+        URING_REQUIRE(prep_return_out(index));
+        break;
+      }
+      case CONNECTION_RETURN_OUT: {
+        if (result == -ECONNRESET || result == -EPIPE) {
+          URING_REQUIRE(drop(index));
+          break;
+        }
+        URING_REQUIRE(result);
+        Echo &echo = echoes[index];
+        count(counters.bytes_sent, result);
+        if (echo.spliced) {
+          count(counters.spliced_bytes_sent, result);
+        }
+        echo.returning -= result;
+        echo.return_offset += result;
+        if (echo.returning) {
+          count(counters.short_writes_echo, 1);
+          URING_REQUIRE(prep_return_out(index));
+        } else {
+          URING_REQUIRE(prep_return_in(index));
+        }
+        break;
+      }
+      default:
+        std::abort();
+    }
+    if (!io_uring_cq_ready(&ring)) {
+      io_uring_submit(&ring);
     }
+  }
 
-    io_uring_sqe *sqe;
-    io_uring_cqe *cqe;
-    IOEntryContext io_ctx;
+  if (idle_ticks >= 2) {
+    std::cerr << "Nothing more to read.\n";
+  }
 
-    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
-    io_ctx.op = IOEntryContext::SEND;
-    io_ctx.bytes_desired = bytes_to_send;
-    io_ctx.to_fd = conn1fd;
-    io_uring_prep(sqe, io_ctx, 0, buffer.data());
+  // Shut the connections down, so that the operations still in flight on
+  // them complete at once rather than after the buffers are gone.
+  for (Echo &echo : echoes) {
+    for (const int fd : {echo.fd, echo.upstream}) {
+      if (fd >= 0) {
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+      }
+    }
+    for (const int fd : {echo.pipe[0], echo.pipe[1], echo.return_pipe[0],
+                         echo.return_pipe[1]}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+  if (shards.own_process) {
+    URING_REQUIRE(publish_cpu());
+  }
+  return 0;
+}
 
-    PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
-    io_ctx.op = IOEntryContext::SEND;
-    io_ctx.bytes_desired = bytes_to_send;
-    io_ctx.to_fd = conn2fd;
-    io_uring_prep(sqe, io_ctx, 0, buffer.data());
+// Serve each connection accepted from `listen_fd` from a ring of its own, as
+// the only shard of `shards`, until `shards.stop` is set or until killed: if
+// `shards.upstream_listener` is set, forward it to the next hop of proxy mode,
+// with `splice()` if `use_pipes` is true and with `recv()` and `send()`
+// otherwise; if not, echo it with `recv()` and `send()` as the stand-in
+// backend. Buffers are `bufsize` bytes.
+int relay_connections(int bufsize, int listen_fd, bool use_pipes,
+                      Shards &shards) {
+  io_uring ring;
+  URING_REQUIRE(io_uring_queue_init(4096, &ring, 0));
+  const int rc = echo_connections(
+      bufsize, ring, listen_fd, {},
+      use_pipes && shards.upstream_listener >= 0, 0, shards, 0, nullptr);
+  io_uring_queue_exit(&ring);
+  return rc;
+}
 
-    // std::cerr << "Submitting two unchained send() operations to io_uring.\n";
-    io_uring_submit(&ring);
+// Echo everything received on each echo connection back to it as
+// `echo_connections` does with `use_pipes` and `hybrid_threshold`, or proxy it
+// to the backend listening on `upstream_listener` unless it is -1, using
+// `threads` threads, or, if `processes` is set, as many worker processes: the
+// connections `fds`, and those accepted from `listen_fd` until the monitor is
+// finished. The calling thread accepts the connections, hands each to the
+// shard with the fewest open, and polls `monitor`. With threads, it also
+// serves `fds` from `ring`, and each other thread serves the connections
+// handed to it from a ring of its own with the same setup flags. With
+// processes, it serves no connection, and each worker, forked before the first
+// is accepted and again if it exits, receives its connections over a Unix
+// socket and serves them from a ring of its own. Read sizes are recorded by
+// the calling thread only, and worker processes are not traced.
+int server_connections(int bufsize, io_uring &ring, int listen_fd,
+                       std::span<const int> fds, bool use_pipes,
+                       int hybrid_threshold, int upstream_listener,
+                       int threads, bool processes, Tracer &tracer,
+                       Monitor &monitor) {
+  const int shard_count = processes ? 1 + threads : threads;
+  ShardCounters *const counters = map_shared<ShardCounters>(shard_count);
+  PTR_REQUIRE(counters);
+  Shards shards({counters, std::size_t(shard_count)});
+  shards.upstream_listener = upstream_listener;
+  monitor.count_shards(shards.counters);
+  std::vector<int> results(threads);
+  // Counted down by each other thread once its ring is set up, or is not.
+  std::latch ready(processes ? 0 : threads - 1);
 
-    for (int j = 0; j < 2; j++) {
-      // std::cerr << "Waiting for a completion from io_uring. j=" << j << '\n';
-      URING_REQUIRE(io_uring_wait_cqe(&ring, &cqe));
-      // TODO: handle EINTR
-      URING_REQUIRE(cqe->res);
-      const int result = cqe->res;
-      io_ctx = std::bit_cast<IOEntryContext>(io_uring_cqe_get_data64(cqe));
-      io_uring_cqe_seen(&ring, cqe);
-      metrics.bytes_sent += result;
-      if (result < io_ctx.bytes_desired) {
-        // TODO: This should only happen on account of a signal.
-        if (io_ctx.to_fd == conn1fd) {
-          ++metrics.short_writes_echo;
-        } else if (io_ctx.to_fd == conn2fd) {
-          ++metrics.short_writes_observer;
+  std::vector<std::jthread> workers;
+  if (processes) {
+    shards.start_worker = [&](int shard) {
+      int sockets[2];
+      POSIX_REQUIRE(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets));
+      switch (const pid_t pid = fork()) {
+        case 0:
+          break;
+        case -1: {
+          const int err = errno;
+          std::cerr << "error forking worker " << shard << ": "
+                    << std::strerror(err) << '\n';
+          close(sockets[0]);
+          close(sockets[1]);
+          return -err;
         }
-        io_ctx.bytes_desired -= result;
-        PTR_REQUIRE(sqe = io_uring_get_sqe(&ring));
-        io_uring_prep(sqe, io_ctx, 0, buffer.data() + result);
-        io_uring_submit(&ring);
-        --j;
+        default:
+          close(sockets[1]);
+          shards.channels[shard] = sockets[0];
+          shards.workers[shard] = pid;
+          return 0;
+      }
+      // child
+      // Only the acceptor may hold the other end of any worker's socket, so
+      // that the worker sees it hang up.
+      for (int &channel : shards.channels) {
+        if (channel >= 0) {
+          close(channel);
+        }
+        channel = -1;
       }
+      close(sockets[0]);
+      shards.channels[shard] = sockets[1];
+      shards.workers.assign(shards.workers.size(), -1);
+      shards.own_process = true;
+      for (const int fd : fds) {
+        close(fd);
+      }
+      close(listen_fd);
+      // The tracer's flusher thread did not survive the fork.
+      Tracer::trace_buffer = nullptr;
+      io_uring worker_ring;
+      int rc = io_uring_queue_init(4096, &worker_ring, ring.flags);
+      if (rc < 0) {
+        std::cerr << "Unable to set up the ring of worker " << shard << ": "
+                  << std::strerror(-rc) << '\n';
+        std::exit(rc);
+      }
+      rc = echo_connections(bufsize, worker_ring, -1, {}, use_pipes,
+                            hybrid_threshold, shards, shard, nullptr);
+      io_uring_queue_exit(&worker_ring);
+      std::exit(rc);
+    };
+    for (int shard = 1; shard < shard_count; ++shard) {
+      URING_REQUIRE(shards.start_worker(shard));
     }
+  } else {
+    shards.rings[0] = ring.ring_fd;
+  }
+  for (int thread = 1; thread < threads && !processes; ++thread) {
+    workers.emplace_back([&, thread]() {
+      if (tracer.enabled()) {
+        tracer.register_thread();
+      }
+      io_uring worker_ring;
+      int &rc = results[thread];
+      rc = io_uring_queue_init(4096, &worker_ring, ring.flags);
+      if (rc < 0) {
+        std::cerr << "Unable to set up the ring of thread " << thread << ": "
+                  << std::strerror(-rc) << '\n';
+        ready.count_down();
+        return;
+      }
+      shards.rings[thread] = worker_ring.ring_fd;
+      ready.count_down();
+      rc = echo_connections(bufsize, worker_ring, -1, {}, use_pipes,
+                            hybrid_threshold, shards, thread, nullptr);
+      io_uring_queue_exit(&worker_ring);
+    });
   }
 
+  ready.wait();
+  results[0] = echo_connections(bufsize, ring, listen_fd, fds, use_pipes,
+                                hybrid_threshold, shards, 0, &monitor);
+  shards.stop = true;
+  workers.clear();
+  // Hang up on the worker processes, which then exit.
+  for (std::size_t shard = 0; shard < shards.workers.size(); ++shard) {
+    if (shards.channels[shard] >= 0) {
+      close(shards.channels[shard]);
+    }
+    if (shards.workers[shard] >= 0) {
+      waitpid(shards.workers[shard], nullptr, 0);
+    }
+  }
+  monitor.count_shards({});
+  get_resource_usage(monitor.metrics);
+  get_shard_usage(monitor.metrics, shards.counters);
+  munmap(counters, shard_count * sizeof(ShardCounters));
+  for (const int rc : results) {
+    if (rc) {
+      return rc;
+    }
+  }
   return 0;
 }
 
 void usage(std::ostream &out, const char *argv0) {
   out << "usage: " << argv0
-      << " <recvsend | splicetee> <tcp | unix> <#pages>\n"
+      << " <recvsend | splicetee | hybrid | proxy | shm> "
+         "<tcp | unix>[:<tcp | unix>] <#pages> [options...]\n"
+         "\nhybrid serves each echo connection with recvsend or with splice, "
+         "whichever\nsuits the sizes of its reads, and has no observer. proxy "
+         "connects each echo\nconnection to a stand-in echo backend and "
+         "splices both ways between them,\nlogging the bytes sent both ways, "
+         "and has no observer: it is splicetee with\n--hops=1 or more. shm "
+         "echoes through rings in shared memory instead of the\nsockets, "
+         "which the clients connect only to meet the server and see it "
+         "hang up.\n"
+         "\nWith two families, e.g. tcp:unix, the echo clients connect with "
+         "the first,\nand the observer and each hop with the second, so that "
+         "the server forwards\nfrom one family to the other.\n"
+         "\noptions:\n"
+         "  --format=<text | jsonl | csv>  format of the log file (default: "
+         "text)\n"
+         "  --log=<path>                   path of the log file (default: "
+         "log)\n"
+         "  --metrics-socket=<path>        serve current metrics on a Unix "
+         "socket\n"
+         "  --trace=<path>                 write a binary trace of every "
+         "operation\n"
+         "  --ring=<default | sqpoll | coop | defer>\n"
+         "                                 io_uring setup flags of the "
+         "server's ring\n"
+         "  --warmup=<seconds>             do not log the first samples "
+         "(default: 0)\n"
+         "  --duration=<seconds>           exit this long after the warm-up "
+         "(default: never)\n"
+         "  --steady-state=<percent>       exit once the 95% confidence "
+         "interval of\n"
+         "                                 mean throughput is within "
+         "<percent> of the mean\n"
+         "  --min-duration=<seconds>       but not sooner than this after the "
+         "warm-up\n"
+         "                                 (default: 10)\n"
+         "  --rate=<MB/s>                  offer this load from an open-loop "
+         "echo client,\n"
+         "                                 and log echo latency percentiles\n"
+         "  --message-size=<bytes>         unit of latency measurement at "
+         "that rate\n"
+         "                                 (default: the buffer size)\n"
+         "  --sizes=<profile>              sizes of the echo client's "
+         "writes and of the\n"
+         "                                 server's reads, one of\n"
+         "                                 fixed[:<bytes>] (default: "
+         "<#pages> pages),\n"
+         "                                 uniform:<min>:<max>,\n"
+         "                                 bimodal:<small>:<large>:<p "
+         "large>,\n"
+         "                                 pareto:<min>:<alpha>[:<max>], or "
+         "replay:<path>\n"
+         "                                 of one size per line; with "
+         "--connections or\n"
+         "                                 --depth, sizes of each connection's "
+         "messages\n"
+         "                                 instead of --message-size\n"
+         "  --connections=<count>          echo this many connections, "
+         "without an observer\n"
+         "                                 (default: 1)\n"
+         "  --threads=<count>              serve the connections from this "
+         "many threads,\n"
+         "                                 and connect them from as many "
+         "client processes\n"
+         "                                 (default: 1; at most one per "
+         "connection)\n"
+         "  --depth=<requests>             send messages as requests, at most "
+         "this many\n"
+         "                                 awaiting their echo per connection,"
+         " and log\n"
+         "                                 requests/s and latency (not with "
+         "--rate)\n"
+         "  --verify                       send a pattern and check it in the "
+         "clients\n"
+         "  --hybrid-threshold=<bytes>     in hybrid mode, splice connections "
+         "whose reads\n"
+         "                                 return this much on average "
+         "(default: 65536)\n"
+         "  --tune                         choose the size of the server's "
+         "reads at run time,\n"
+         "                                 up to <#pages> pages, and log it\n"
+         "  --reconnect=<messages>         replace each echo connection with a "
+         "new one after\n"
+         "                                 this many messages, and log "
+         "accepts/s\n"
+         "  --processes                    serve the connections from "
+         "--threads worker\n"
+         "                                 processes, to which an acceptor "
+         "hands them\n"
+         "  --hops=<count>                 forward each echo connection "
+         "through this many\n"
+         "                                 hops, the server being the first, "
+         "to an echo\n"
+         "                                 backend, and log CPU per GB per "
+         "hop\n"
+         "  --hop-threads                  run the hops after the first as "
+         "threads of the\n"
+         "                                 server instead of processes\n"
+         "  --tap=<path>                   in splicetee mode, splice what the "
+         "observer would\n"
+         "                                 get into this file instead\n"
+         "  --tap-size=<bytes>             preallocate tap files of this "
+         "size, and write\n"
+         "                                 <path>.0, <path>.1, ... in turn\n"
+         "  --replay=<path>                send this file that a tap wrote "
+         "from the echo\n"
+         "                                 client, over and over, instead "
+         "of zeros\n"
+         "  --replay-timing                send it at the timing of its "
+         "capture instead of\n"
+         "                                 as fast as possible\n"
          "\nfor example: "
-      << argv0 << " recvsend tcp 16\n";
+      << argv0 << " recvsend tcp 16 --format=jsonl --log=run.jsonl\n";
+}
+
+// Raise the soft limit on open files to at least `needed`. Return zero on
+// success or `-errno` if an error occurs, e.g. if the hard limit is lower.
+int raise_open_files_limit(rlim_t needed) {
+  rlimit limit;
+  POSIX_REQUIRE(getrlimit(RLIMIT_NOFILE, &limit));
+  if (limit.rlim_cur >= needed) {
+    return 0;
+  }
+  if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+    std::cerr << needed << " open files are needed, but the hard limit is "
+              << limit.rlim_max << ".\n";
+    return -EMFILE;
+  }
+  limit.rlim_cur = needed;
+  POSIX_REQUIRE(setrlimit(RLIMIT_NOFILE, &limit));
+  return 0;
+}
+
+// If `arg` begins with `name` followed by '=', return the rest of `arg`.
+// Otherwise, return null.
+std::optional<std::string_view> option_value(std::string_view arg,
+                                             std::string_view name) {
+  if (arg.starts_with(name) && arg.substr(name.size()).starts_with('=')) {
+    return arg.substr(name.size() + 1);
+  }
+  return std::nullopt;
 }
 
 int main(int argc, char *argv[]) {
-  enum { RECVSEND, SPLICETEE } server_mode;
-  std::unique_ptr<Net> net;
+  enum { RECVSEND, SPLICETEE, HYBRID, PROXY, SHM } server_mode;
+  // Of the echo clients, and of the observer and the hops, which differ if
+  // two families are given, e.g. tcp:unix.
+  std::unique_ptr<Net> net, upstream_net;
   int bufsize;
+  RunInfo run;
+  Format format = Format::TEXT;
+  std::string log_path = "log";
+  std::string metrics_socket;
+  std::string trace_path;
+  std::string tap_path;
+  std::string replay_path;
 
-  if (argc != 4) {
+  if (argc < 4) {
     usage(std::cerr, argv[0]);
     return 1;
   }
@@ -606,6 +4871,12 @@ int main(int argc, char *argv[]) {
     server_mode = RECVSEND;
   } else if (arg == "splicetee") {
     server_mode = SPLICETEE;
+  } else if (arg == "hybrid") {
+    server_mode = HYBRID;
+  } else if (arg == "proxy") {
+    server_mode = PROXY;
+  } else if (arg == "shm") {
+    server_mode = SHM;
   } else {
     usage(std::cerr, argv[0]);
     return 2;
@@ -615,79 +4886,447 @@ int main(int argc, char *argv[]) {
     usage(std::cout, argv[0]);
     return 0;
   }
-  if (arg == "tcp") {
-    net = std::make_unique<TCP>();
-  } else if (arg == "unix") {
-    net = std::make_unique<Unix>();
+  if (const auto colon = arg.find(':'); colon != std::string_view::npos) {
+    upstream_net = make_net(arg.substr(colon + 1));
+    net = make_net(arg.substr(0, colon));
+    if (!upstream_net) {
+      net.reset();
+    }
   } else {
+    net = make_net(arg);
+  }
+  if (!net) {
     usage(std::cerr, argv[0]);
     return 2;
   }
+  Net &upstream = upstream_net ? *upstream_net : *net;
   arg = argv[3];
-  bufsize = std::stoi(std::string{arg}) * getpagesize();
+  run.pages = std::stoi(std::string{arg});
+  bufsize = run.pages * getpagesize();
+  run.mode = argv[1];
+  run.family = argv[2];
+  run.bufsize = bufsize;
+
+  for (int i = 4; i < argc; ++i) {
+    arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      usage(std::cout, argv[0]);
+      return 0;
+    }
+    if (const auto value = option_value(arg, "--format")) {
+      if (*value == "text") {
+        format = Format::TEXT;
+      } else if (*value == "jsonl") {
+        format = Format::JSONL;
+      } else if (*value == "csv") {
+        format = Format::CSV;
+      } else {
+        usage(std::cerr, argv[0]);
+        return 2;
+      }
+    } else if (const auto value = option_value(arg, "--log")) {
+      log_path = *value;
+    } else if (const auto value = option_value(arg, "--metrics-socket")) {
+      metrics_socket = *value;
+    } else if (const auto value = option_value(arg, "--trace")) {
+      trace_path = *value;
+    } else if (const auto value = option_value(arg, "--tap")) {
+      tap_path = *value;
+      run.tap = true;
+    } else if (const auto value = option_value(arg, "--replay")) {
+      replay_path = *value;
+      run.replay = true;
+    } else if (arg == "--replay-timing") {
+      run.replay_timing = true;
+    } else if (const auto value = option_value(arg, "--replay-timing")) {
+      run.replay_timing = *value != "0";
+    } else if (const auto value = option_value(arg, "--tap-size")) {
+      run.tap_size = std::max(0ll, std::stoll(std::string{*value}));
+    } else if (const auto value = option_value(arg, "--ring")) {
+      if (!ring_profile_flags(*value)) {
+        usage(std::cerr, argv[0]);
+        return 2;
+      }
+      run.ring_profile = *value;
+    } else if (const auto value = option_value(arg, "--warmup")) {
+      run.warmup = std::chrono::seconds(std::stoi(std::string{*value}));
+    } else if (const auto value = option_value(arg, "--duration")) {
+      run.duration = std::chrono::seconds(std::stoi(std::string{*value}));
+    } else if (const auto value = option_value(arg, "--steady-state")) {
+      run.steady_state_percent = std::stod(std::string{*value});
+    } else if (const auto value = option_value(arg, "--min-duration")) {
+      run.min_duration = std::chrono::seconds(std::stoi(std::string{*value}));
+    } else if (const auto value = option_value(arg, "--rate")) {
+      run.rate = std::stod(std::string{*value});
+    } else if (const auto value = option_value(arg, "--message-size")) {
+      run.message_size = std::stoi(std::string{*value});
+    } else if (const auto value = option_value(arg, "--sizes")) {
+      run.sizes = *value;
+    } else if (const auto value = option_value(arg, "--connections")) {
+      run.connections = std::max(1, std::stoi(std::string{*value}));
+    } else if (const auto value = option_value(arg, "--threads")) {
+      run.threads = std::max(1, std::stoi(std::string{*value}));
+    } else if (arg == "--verify") {
+      run.verify = true;
+    } else if (const auto value = option_value(arg, "--verify")) {
+      run.verify = *value != "0";
+    } else if (const auto value = option_value(arg, "--hybrid-threshold")) {
+      run.hybrid_threshold = std::max(1, std::stoi(std::string{*value}));
+    } else if (arg == "--tune") {
+      run.tune = true;
+    } else if (const auto value = option_value(arg, "--tune")) {
+      run.tune = *value != "0";
+    } else if (const auto value = option_value(arg, "--depth")) {
+      run.depth = std::max(0, std::stoi(std::string{*value}));
+    } else if (const auto value = option_value(arg, "--reconnect")) {
+      run.reconnect = std::max(0, std::stoi(std::string{*value}));
+    } else if (const auto value = option_value(arg, "--hops")) {
+      run.hops = std::max(0, std::stoi(std::string{*value}));
+    } else if (arg == "--hop-threads") {
+      run.hop_threads = true;
+    } else if (const auto value = option_value(arg, "--hop-threads")) {
+      run.hop_threads = *value != "0";
+    } else if (arg == "--processes") {
+      run.processes = true;
+    } else if (const auto value = option_value(arg, "--processes")) {
+      run.processes = *value != "0";
+    } else {
+      usage(std::cerr, argv[0]);
+      return 2;
+    }
+  }
+  if (!run.message_size) {
+    run.message_size = bufsize;
+  }
+  run.threads = std::min(run.threads, run.connections);
+  if (server_mode == PROXY) {
+    run.hops = std::max(1, run.hops);
+  }
+  if (run.hops && server_mode == HYBRID) {
+    std::cerr << "--hops is not supported in hybrid mode.\n";
+    return 2;
+  }
+  if (run.tap && (server_mode != SPLICETEE || run.connections > 1 ||
+                  run.reconnect || run.processes || run.hops)) {
+    std::cerr << "--tap is supported only in splicetee mode, with a single "
+                 "echo connection\nand no hops.\n";
+    return 2;
+  }
+  if (server_mode == SHM &&
+      (run.rate || run.connections > 1 || run.reconnect || run.processes ||
+       run.hops || run.verify || run.tap || run.replay ||
+       !metrics_socket.empty())) {
+    std::cerr << "shm mode supports only a single echo connection, not "
+                 "--rate, --connections,\n--reconnect, --processes, --hops, "
+                 "--verify, --tap, --replay or\n--metrics-socket.\n";
+    return 2;
+  }
+  if (run.depth && run.rate) {
+    std::cerr << "--depth keeps requests in flight in closed loop, and cannot "
+                 "be combined with\nthe open loop of --rate.\n";
+    return 2;
+  }
+  if (run.replay &&
+      (run.verify || run.rate || run.depth || run.connections > 1 ||
+       run.reconnect || run.processes || run.hops || server_mode == HYBRID)) {
+    std::cerr << "--replay is supported only with the streaming echo client, "
+                 "not with --verify,\n--rate, --depth, --connections, "
+                 "--reconnect, --processes, --hops or hybrid or\nproxy "
+                 "mode.\n";
+    return 2;
+  }
+  if (run.replay && access(replay_path.c_str(), R_OK)) {
+    const int err = errno;
+    std::cerr << "Unable to read " << replay_path << ": " << std::strerror(err)
+              << '\n';
+    return 1;
+  }
+  if (std::error_code error;
+      run.replay && fs::file_size(replay_path, error) == 0) {
+    // Replaying it would start it over and over without sending anything.
+    std::cerr << "Nothing to replay: " << replay_path << " is empty.\n";
+    return 1;
+  }
+  // Fail now rather than after the whole run if the log cannot be written.
+  if (!std::ofstream(log_path)) {
+    const int err = errno;
+    std::cerr << "Unable to open " << log_path << ": " << std::strerror(err)
+              << '\n';
+    return 1;
+  }
+  if (run.verify &&
+      (run.rate || run.depth || run.connections > 1 || run.reconnect ||
+       run.processes || run.hops || server_mode == HYBRID)) {
+    std::cerr << "--verify is supported only with the streaming echo client, "
+                 "not with --rate, --depth, --connections, --reconnect, "
+                 "--processes, --hops or hybrid or proxy mode.\n";
+    return 2;
+  }
+  if (run.tune && (run.connections > 1 || run.reconnect || run.processes ||
+                   run.hops || server_mode == HYBRID)) {
+    std::cerr << "--tune is supported only with a single echo connection, "
+                 "not with --reconnect, --processes, --hops or in hybrid or "
+                 "proxy mode.\n";
+    return 2;
+  }
+  std::optional<SizeDistribution> sizes =
+      SizeDistribution::parse(run.sizes, bufsize);
+  if (!sizes) {
+    std::cerr << "Invalid size profile: " << run.sizes << '\n';
+    usage(std::cerr, argv[0]);
+    return 2;
+  }
+  sizes->seed(2);
 
   int listen1fd = -1, conn1fd = -1;
   int pipe1fds[2] = {-1, -1};
   int listen2fd = -1, conn2fd = -1;
   int pipe2fds[2] = {-1, -1};
+  // With hops, where each hop after the first listens, and then where the
+  // backend does, and what those running as threads share with the server.
+  std::vector<int> relay_fds;
+  std::deque<Shards> relays;
+  std::vector<std::jthread> relay_threads;
 
   io_uring ring;
+  Tracer tracer;
+
+  // One for each forked client: the sink and the source-and-sink, or the sink
+  // and one per thread sharing many connections.
+  const int num_clients = 1 + run.threads;
+  ClientCounters *const clients = map_shared<ClientCounters>(num_clients);
+  if (!clients) {
+    return 3;
+  }
+  // The echo clients and, in proxy mode, the backend, which are stopped at
+  // the end.
+  std::vector<pid_t> children;
 
   const int rc = [&]() {
+    const bool many = run.connections > 1 || run.reconnect || run.processes ||
+                      run.hops || server_mode == HYBRID;
+    if (many) {
+      // A socket and a pipe per connection, plus a few to spare. A forwarded
+      // connection has two of each in each hop.
+      URING_REQUIRE(raise_open_files_limit(
+          (run.hops ? 6 * run.hops : 3) * run.connections + 64));
+    }
     POSIX_REQUIRE(pipe(pipe1fds));
     POSIX_REQUIRE(pipe(pipe2fds));
-    URING_REQUIRE(listen1fd = net->server_socket(1));
-    URING_REQUIRE(listen2fd = net->server_socket(1));
-
-    // fork() to client_sink(...).
-    switch (fork()) {
-      case 0:
-        // child
-        // TODO: Should close all file descriptors except 0 and 1, but meh.
-        std::exit(client_sink(bufsize, *net, listen2fd));
-      case -1: {
-        const int err = errno;
-        std::cerr << "error forking to client_sink(): " << std::strerror(err)
-                  << '\n';
-        return err;
+    URING_REQUIRE(listen1fd = net->server_socket(many ? SOMAXCONN : 1));
+    // In shm mode, the rings from the echo client to the server and back, and
+    // to the observer, which the clients share by fork().
+    ShmRing echo_in, echo_out, observer_ring;
+    if (server_mode == SHM) {
+      const std::size_t capacity =
+          std::bit_ceil(4 * std::size_t(std::max(bufsize, 65536)));
+      for (ShmRing *const shm_ring : {&echo_in, &echo_out, &observer_ring}) {
+        URING_REQUIRE(shm_ring->create(capacity));
       }
     }
 
-    // fork() to client_source_and_sink(...).
-    switch (fork()) {
-      case 0:
-        // child
-        // TODO: Should close all file descriptors except 0 and 1, but meh.
-        std::exit(client_source_and_sink(bufsize, *net, listen1fd));
-      case -1: {
-        const int err = errno;
-        std::cerr << "error forking to client_source_and_sink(): "
-                  << std::strerror(err) << '\n';
-        return err;
+    // fork() to client_sink(...), unless the observer is a tap.
+    if (!run.tap) {
+      URING_REQUIRE(listen2fd = upstream.server_socket(1));
+      switch (fork()) {
+        case 0:
+          // child
+          // TODO: Should close all file descriptors except 0 and 1, but meh.
+          if (server_mode == SHM) {
+            std::exit(client_shm_sink(upstream, listen2fd, clients[0],
+                                      observer_ring));
+          }
+          std::exit(client_sink(bufsize, upstream, listen2fd, clients[0],
+                                run.verify));
+        case -1: {
+          const int err = errno;
+          std::cerr << "error forking to client_sink(): "
+                    << std::strerror(err) << '\n';
+          return err;
+        }
       }
     }
 
-    URING_REQUIRE(io_uring_queue_init(8, &ring, 0));
+    // fork() to relay_connections(...) for the backend and, unless they are
+    // threads, for each hop after the first, which forwards to the next.
+    ShardCounters *const relay_counters =
+        run.hops ? map_shared<ShardCounters>(run.hops) : nullptr;
+    if (run.hops) {
+      PTR_REQUIRE(relay_counters);
+    }
+    for (int hop = 0; hop < run.hops; ++hop) {
+      URING_REQUIRE(
+          relay_fds.emplace_back(upstream.server_socket(SOMAXCONN)));
+    }
+    for (std::size_t relay = 0; relay < relay_fds.size(); ++relay) {
+      Shards &shards = relays.emplace_back(
+          std::span<ShardCounters>(relay_counters + relay, 1));
+      const bool backend = relay + 1 == relay_fds.size();
+      if (!backend) {
+        shards.upstream_listener = relay_fds[relay + 1];
+      }
+      if (run.hop_threads && !backend) {
+        continue;
+      }
+      switch (const pid_t pid = fork()) {
+        case 0:
+          // child
+          shards.own_process = !backend;
+          std::exit(relay_connections(bufsize, relay_fds[relay],
+                                      server_mode != RECVSEND, shards));
+        case -1: {
+          const int err = errno;
+          std::cerr << "error forking to relay_connections(): "
+                    << std::strerror(err) << '\n';
+          return err;
+        }
+        default:
+          children.push_back(pid);
+      }
+    }
+
+    // fork() to client_source_and_sink(...), client_open_loop(...) or
+    // client_connections(...), the latter once per thread.
+    for (int client = 1; client < num_clients; ++client) {
+      switch (const pid_t pid = fork()) {
+        case 0:
+          break;
+        case -1: {
+          const int err = errno;
+          std::cerr << "error forking to an echo client: "
+                    << std::strerror(err) << '\n';
+          return err;
+        }
+        default:
+          children.push_back(pid);
+          continue;
+      }
+      // child
+      // TODO: Should close all file descriptors except 0 and 1, but meh.
+      if (server_mode == SHM) {
+        sizes->seed(1);
+        std::exit(client_shm_source_and_sink(*net, listen1fd, clients[1],
+                                             echo_in, echo_out, *sizes,
+                                             run.depth, run.message_size));
+      }
+      if (many || run.depth) {
+        const int share = run.connections * client / run.threads -
+                          run.connections * (client - 1) / run.threads;
+        SizeDistribution message_sizes =
+            run.sizes == "fixed"
+                ? *SizeDistribution::parse(
+                      "fixed:" + std::to_string(run.message_size), bufsize)
+                : *sizes;
+        message_sizes.seed(client);
+        std::exit(client_connections(
+            bufsize, *net, listen1fd, clients[client], share,
+            run.rate * 1'000'000 * share / run.connections, message_sizes,
+            std::max(1, run.depth), run.reconnect));
+      }
+      if (run.rate > 0) {
+        std::exit(client_open_loop(bufsize, *net, listen1fd, clients[1],
+                                   run.rate * 1'000'000, run.message_size));
+      }
+      if (run.replay) {
+        std::exit(client_replay(bufsize, *net, listen1fd, clients[1],
+                                replay_path, run.replay_timing));
+      }
+      sizes->seed(1);
+      std::exit(client_source_and_sink(bufsize, *net, listen1fd, clients[1],
+                                       *sizes, run.verify));
+    }
+
+    URING_REQUIRE(
+        io_uring_queue_init(many ? 4096 : 8, &ring,
+                            *ring_profile_flags(run.ring_profile)));
+    run.ring_flags = ring.flags;
 
-    std::cerr << "Waiting for observer client to connect on observer socket.\n";
-    POSIX_REQUIRE(conn2fd = accept(listen2fd, NULL, NULL));
-    std::cerr << "Observer connection established.\n";
+    Tap tap;
+    if (run.tap) {
+      URING_REQUIRE(tap.open_file(tap_path, run.tap_size));
+    } else {
+      std::cerr
+          << "Waiting for observer client to connect on observer socket.\n";
+      POSIX_REQUIRE(conn2fd = accept(listen2fd, NULL, NULL));
+      std::cerr << "Observer connection established.\n";
+    }
 
     std::cerr << "Waiting for echo client to connect on echo socket.\n";
     POSIX_REQUIRE(conn1fd = accept(listen1fd, NULL, NULL));
     std::cerr << "Echo connection established.\n\n";
+    // With many connections, the server accepts the others as they come and
+    // closes each when the client does. The monitor watches a duplicate of
+    // the first, unless the clients replace their connections.
+    int first_echo_fd = -1;
+    if (many) {
+      first_echo_fd = conn1fd;
+      conn1fd = -1;
+      if (!run.reconnect) {
+        POSIX_REQUIRE(conn1fd = dup(first_echo_fd));
+      }
+    }
+
+    // Declared before the monitor, which reports on it until destroyed.
+    std::optional<SizeTuner> tuner;
+    Monitor monitor(run, format, log_path,
+                    {clients, std::size_t(num_clients)});
+    if (conn1fd >= 0) {
+      URING_REQUIRE(monitor.watch("echo", conn1fd));
+    }
+    if (conn2fd >= 0) {
+      URING_REQUIRE(monitor.watch("observer", conn2fd));
+    }
+    if (!trace_path.empty()) {
+      URING_REQUIRE(tracer.open(trace_path));
+      tracer.register_thread();
+    }
+    if (!metrics_socket.empty()) {
+      URING_REQUIRE(monitor.serve_metrics(metrics_socket, ring));
+    }
 
+    if (many) {
+      if (run.hops) {
+        // Only the hops that are processes publish their CPU time.
+        monitor.count_relays({relay_counters, std::size_t(run.hops - 1)});
+      }
+      for (std::size_t relay = 0; run.hop_threads && relay + 1 < relays.size();
+           ++relay) {
+        relay_threads.emplace_back([&, relay]() {
+          relay_connections(bufsize, relay_fds[relay], server_mode != RECVSEND,
+                            relays[relay]);
+        });
+      }
+      return server_connections(
+          bufsize, ring, listen1fd, {&first_echo_fd, 1},
+          server_mode != RECVSEND,
+          server_mode == HYBRID ? run.hybrid_threshold : 0,
+          run.hops ? relay_fds[0] : -1, run.threads, run.processes, tracer,
+          monitor);
+    }
+    if (run.tune) {
+      monitor.watch_tuner(tuner.emplace(getpagesize(), run.pages));
+    }
+    SizeTuner *const tuner_or_null = tuner ? &*tuner : nullptr;
     switch (server_mode) {
       case RECVSEND:
-        return server_recvsend(bufsize, ring, conn1fd, conn2fd);
+        return server_recvsend(ring, conn1fd, conn2fd, bufsize, *sizes,
+                               tuner_or_null, monitor);
       case SPLICETEE:
-        return server_splicetee(bufsize, ring, conn1fd, conn2fd, pipe1fds,
-                                pipe2fds);
+        return server_splicetee(ring, conn1fd, conn2fd, pipe1fds, pipe2fds,
+                                *sizes, tuner_or_null,
+                                run.tap ? &tap : nullptr, monitor);
+      case SHM:
+        return server_shm(conn1fd, echo_in, echo_out, observer_ring, *sizes,
+                          tuner_or_null, monitor);
       default:
         std::unreachable();
     }
   }();
 
+  for (Shards &shards : relays) {
+    shards.stop = true;
+  }
+  relay_threads.clear();
   io_uring_queue_exit(&ring);
   for (const int fd : {conn1fd, listen1fd, pipe1fds[0], pipe1fds[1], conn2fd,
                        listen2fd, pipe2fds[0], pipe2fds[1]}) {
@@ -695,8 +5334,19 @@ int main(int argc, char *argv[]) {
       close(fd);
     }
   }
+  for (const int fd : relay_fds) {
+    close(fd);
+  }
 
-  wait(0);
+  // Stop the echo clients instead of waiting for them to notice that the
+  // server is gone: a connection accepted just as the run ended is never
+  // served, and so is not closed before the server exits.
+  for (const pid_t pid : children) {
+    kill(pid, SIGTERM);
+  }
+  for (const pid_t pid : children) {
+    waitpid(pid, nullptr, 0);
+  }
 
   return rc;
 }
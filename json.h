@@ -0,0 +1,171 @@
+#ifndef JSON_H_
+#define JSON_H_
+
+// Minimal JSON support shared by the programs in this directory, which write
+// and read flat JSON objects, one per line (JSONL).
+
+#include <cctype>
+#include <charconv>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Write `value` to `out` as a JSON string.
+inline void json_quote(std::ostream &out, std::string_view value) {
+  out << '"';
+  for (const char ch : value) {
+    switch (ch) {
+      case '"':
+        out << "\\\"";
+        break;
+      case '\\':
+        out << "\\\\";
+        break;
+      case '\n':
+        out << "\\n";
+        break;
+      case '\t':
+        out << "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(ch) < 0x20) {
+          const char *const hex = "0123456789abcdef";
+          out << "\\u00" << hex[ch >> 4] << hex[ch & 0xf];
+        } else {
+          out << ch;
+        }
+    }
+  }
+  out << '"';
+}
+
+// Members of a flat JSON object, in order of appearance. String values are
+// unescaped, and other values (numbers, `true`, `false`, `null`) are kept as
+// their text.
+using JsonObject = std::vector<std::pair<std::string, std::string>>;
+
+// Return the value of the member of `object` named `name`, if any.
+inline const std::string *json_find(const JsonObject &object,
+                                    std::string_view name) {
+  for (const auto &[key, value] : object) {
+    if (key == name) {
+      return &value;
+    }
+  }
+  return nullptr;
+}
+
+// Parse `text` as a JSON object whose values are all scalars. Return nothing
+// if `text` is not such an object. `\u` escapes outside of ASCII are not
+// supported and are replaced by '?'.
+inline std::optional<JsonObject> json_parse_flat(std::string_view text) {
+  std::size_t i = 0;
+  const auto skip_space = [&]() {
+    while (i < text.size() &&
+           std::isspace(static_cast<unsigned char>(text[i]))) {
+      ++i;
+    }
+  };
+  const auto parse_string = [&]() -> std::optional<std::string> {
+    if (i >= text.size() || text[i] != '"') {
+      return std::nullopt;
+    }
+    std::string result;
+    for (++i; i < text.size() && text[i] != '"'; ++i) {
+      if (text[i] != '\\') {
+        result += text[i];
+        continue;
+      }
+      if (++i == text.size()) {
+        return std::nullopt;
+      }
+      switch (text[i]) {
+        case 'n':
+          result += '\n';
+          break;
+        case 't':
+          result += '\t';
+          break;
+        case 'r':
+          result += '\r';
+          break;
+        case 'b':
+          result += '\b';
+          break;
+        case 'f':
+          result += '\f';
+          break;
+        case 'u': {
+          if (i + 4 >= text.size()) {
+            return std::nullopt;
+          }
+          const char *const digits = text.data() + i + 1;
+          unsigned code;
+          const auto [end, error] =
+              std::from_chars(digits, digits + 4, code, 16);
+          if (error != std::errc() || end != digits + 4) {
+            return std::nullopt;
+          }
+          result += code < 0x80 ? char(code) : '?';
+          i += 4;
+          break;
+        }
+        default:
+          result += text[i];
+      }
+    }
+    if (i == text.size()) {
+      return std::nullopt;
+    }
+    ++i;  // closing quote
+    return result;
+  };
+
+  JsonObject object;
+  skip_space();
+  if (i == text.size() || text[i++] != '{') {
+    return std::nullopt;
+  }
+  skip_space();
+  if (i < text.size() && text[i] == '}') {
+    return object;
+  }
+  for (;;) {
+    skip_space();
+    auto key = parse_string();
+    skip_space();
+    if (!key || i == text.size() || text[i++] != ':') {
+      return std::nullopt;
+    }
+    skip_space();
+    std::optional<std::string> value;
+    if (i < text.size() && text[i] == '"') {
+      value = parse_string();
+    } else {
+      const std::size_t begin = i;
+      while (i < text.size() && text[i] != ',' && text[i] != '}' &&
+             !std::isspace(static_cast<unsigned char>(text[i]))) {
+        ++i;
+      }
+      if (i > begin) {
+        value = std::string(text.substr(begin, i - begin));
+      }
+    }
+    skip_space();
+    if (!value || i == text.size()) {
+      return std::nullopt;
+    }
+    object.emplace_back(std::move(*key), std::move(*value));
+    if (text[i] == '}') {
+      return object;
+    }
+    if (text[i++] != ',') {
+      return std::nullopt;
+    }
+  }
+}
+
+#endif  // JSON_H_
@@ -0,0 +1,13 @@
+set title 'Echo Latency Versus Offered Load (16 pages)'
+
+set xlabel 'offered load (MB/s)'
+set ylabel 'p99 echo latency (microseconds)'
+
+set logscale y
+
+# set terminal svg size 1024,768 fixed enhanced font 'Arial,12' butt dashlength 1.0
+
+plot 'recvsend-tcp.by-rate' using 1:2:3 with errorlines title 'recvsend-tcp', \
+     'recvsend-unix.by-rate' using 1:2:3 with errorlines title 'recvsend-unix', \
+     'splicetee-tcp.by-rate' using 1:2:3 with errorlines title 'splicetee-tcp', \
+     'splicetee-unix.by-rate' using 1:2:3 with errorlines title 'splicetee-unix'
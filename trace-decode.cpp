@@ -0,0 +1,219 @@
+// Read a binary trace written by `echo-server --trace` and print, for each
+// iteration ("chunk") of the forwarding loop, a timeline of the operations
+// submitted and completed, or a summary of operation and chunk latencies.
+
+extern "C" {
+#include <linux/io_uring.h>
+}  // extern "C"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "trace.h"
+
+void usage(std::ostream &out, const char *argv0) {
+  out << "usage: " << argv0
+      << " [--summary] [--slower-than=<microseconds>] <trace-file>\n"
+         "\nPrint the timeline of each chunk, i.e. each iteration of the "
+         "forwarding\nloop. With --slower-than, print only chunks that took "
+         "longer than the\nspecified duration. With --summary, print latency "
+         "percentiles instead.\n";
+}
+
+const char *operation_name(std::uint8_t op) {
+  if (op < std::size(trace_operation_names)) {
+    return trace_operation_names[op];
+  }
+  return "?";
+}
+
+const char *kind_name(std::uint8_t kind) {
+  switch (kind) {
+    case TRACE_SQE:
+      return "SQE";
+    case TRACE_CQE:
+      return "CQE";
+    case TRACE_SYSCALL:
+      return "SYSCALL";
+  }
+  return "?";
+}
+
+// Return the specified `percentile` of the specified sorted `values`.
+double percentile(const std::vector<double> &values, double percentile) {
+  if (values.empty()) {
+    return 0;
+  }
+  const std::size_t index = std::min(
+      values.size() - 1, std::size_t(percentile / 100 * values.size()));
+  return values[index];
+}
+
+void print_percentiles(std::ostream &out, std::string_view name,
+                       std::vector<double> &microseconds) {
+  std::sort(microseconds.begin(), microseconds.end());
+  out << std::left << std::setw(24) << name << std::right << std::setw(10)
+      << microseconds.size();
+  for (const double p : {50.0, 90.0, 99.0, 99.9}) {
+    out << std::setw(12) << percentile(microseconds, p);
+  }
+  out << std::setw(12) << (microseconds.empty() ? 0 : microseconds.back())
+      << '\n';
+}
+
+int main(int argc, char *argv[]) {
+  bool summary = false;
+  double slower_than = 0;
+  const char *path = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      usage(std::cout, argv[0]);
+      return 0;
+    } else if (arg == "--summary") {
+      summary = true;
+    } else if (arg.starts_with("--slower-than=")) {
+      slower_than = std::stod(std::string(arg.substr(arg.find('=') + 1)));
+    } else if (!path) {
+      path = argv[i];
+    } else {
+      usage(std::cerr, argv[0]);
+      return 2;
+    }
+  }
+  if (!path) {
+    usage(std::cerr, argv[0]);
+    return 2;
+  }
+
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    std::cerr << "Unable to open " << path << '\n';
+    return 1;
+  }
+  TraceFileHeader header;
+  if (!in.read(reinterpret_cast<char *>(&header), sizeof header) ||
+      std::memcmp(header.magic, trace_magic, sizeof trace_magic) ||
+      header.record_size != sizeof(TraceRecord)) {
+    std::cerr << path << " is not a trace file of this version\n";
+    return 1;
+  }
+
+  // Records of each thread, in the order produced.
+  std::map<std::uint32_t, std::vector<TraceRecord>> threads;
+  std::uint64_t dropped = 0;
+  TraceBlockHeader block;
+  while (in.read(reinterpret_cast<char *>(&block), sizeof block)) {
+    std::vector<TraceRecord> &records = threads[block.thread];
+    const std::size_t old_size = records.size();
+    records.resize(old_size + block.count);
+    if (!in.read(reinterpret_cast<char *>(&records[old_size]),
+                 block.count * sizeof(TraceRecord))) {
+      std::cerr << "Trace is truncated; ignoring the last block.\n";
+      records.resize(old_size);
+      break;
+    }
+    dropped += block.dropped;
+  }
+  if (dropped) {
+    std::cerr << "Note: " << dropped
+              << " records were dropped while tracing.\n";
+  }
+
+  std::uint64_t origin = UINT64_MAX;
+  for (const auto &[thread, records] : threads) {
+    if (!records.empty()) {
+      origin = std::min(origin, records.front().nanoseconds);
+    }
+  }
+
+  // Latencies in microseconds, by operation name, from SQE to matching CQE.
+  std::map<std::string, std::vector<double>> op_latencies;
+  std::vector<double> chunk_durations;
+
+  std::cout << std::fixed << std::setprecision(1);
+  for (const auto &[thread, records] : threads) {
+    // Submission times of operations not yet completed, keyed by operation
+    // and file descriptors, oldest first.
+    std::map<std::tuple<int, int, int>, std::deque<std::uint64_t>> pending;
+
+    for (auto begin = records.begin(); begin != records.end();) {
+      const auto end = std::find_if(begin, records.end(), [&](const auto &r) {
+        return r.chunk != begin->chunk;
+      });
+      const std::uint64_t start = begin->nanoseconds;
+      const double duration = ((end - 1)->nanoseconds - start) / 1000.0;
+      chunk_durations.push_back(duration);
+
+      const bool print = !summary && duration >= slower_than;
+      if (print) {
+        std::cout << "thread " << thread << " chunk " << begin->chunk << " at "
+                  << std::setprecision(6) << (start - origin) / 1e9
+                  << std::setprecision(1) << " s, lasting " << duration
+                  << " us\n";
+      }
+      for (auto record = begin; record != end; ++record) {
+        const auto key =
+            std::make_tuple(record->op, record->from_fd, record->to_fd);
+        double latency = -1;
+        if (record->kind == TRACE_SQE) {
+          pending[key].push_back(record->nanoseconds);
+        } else if (record->kind == TRACE_CQE) {
+          auto &queue = pending[key];
+          if (!queue.empty()) {
+            latency = (record->nanoseconds - queue.front()) / 1000.0;
+            queue.pop_front();
+            op_latencies[operation_name(record->op)].push_back(latency);
+          }
+        }
+        if (!print) {
+          continue;
+        }
+        std::cout << std::setw(12) << (record->nanoseconds - start) / 1000.0
+                  << " us  " << std::left << std::setw(8)
+                  << kind_name(record->kind) << std::setw(8)
+                  << operation_name(record->op) << std::right
+                  << std::setw(5) << record->from_fd << " -> " << std::left
+                  << std::setw(5) << record->to_fd << std::right
+                  << " requested " << record->requested;
+        if (record->kind != TRACE_SQE) {
+          std::cout << " returned " << record->result;
+        }
+        if (record->flags) {
+          std::cout << " flags 0x" << std::hex << record->flags << std::dec;
+        }
+        if (record->kind == TRACE_CQE && record->flags & IORING_CQE_F_BUFFER) {
+          std::cout << " buffer " << (record->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (latency >= 0) {
+          std::cout << " after " << latency << " us";
+        }
+        std::cout << '\n';
+      }
+      begin = end;
+    }
+  }
+
+  if (summary) {
+    std::cout << std::left << std::setw(24) << "latency (us)" << std::right
+              << std::setw(10) << "count" << std::setw(12) << "p50"
+              << std::setw(12) << "p90" << std::setw(12) << "p99"
+              << std::setw(12) << "p99.9" << std::setw(12) << "max" << '\n';
+    print_percentiles(std::cout, "chunk", chunk_durations);
+    for (auto &[name, latencies] : op_latencies) {
+      print_percentiles(std::cout, name, latencies);
+    }
+  }
+}
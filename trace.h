@@ -0,0 +1,77 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// On-disk format of the binary event trace written by `echo-server --trace`
+// and read by `trace-decode`.
+//
+// A trace file is a `TraceFileHeader` followed by any number of blocks. Each
+// block is a `TraceBlockHeader` followed by `count` `TraceRecord`s, all from
+// the same thread and in the order in which that thread produced them. Blocks
+// from different threads are interleaved in the order in which they were
+// flushed. All integers are in host byte order.
+
+#include <cstdint>
+
+inline constexpr char trace_magic[8] = {'E', 'S', 'T', 'R', 'A', 'C', 'E', '2'};
+
+struct TraceFileHeader {
+  char magic[8];
+  std::uint32_t record_size;
+  std::uint32_t reserved;
+};
+
+static_assert(sizeof(TraceFileHeader) == 16);
+
+struct TraceBlockHeader {
+  // Index of the producing thread, in order of first use.
+  std::uint32_t thread;
+  // Number of `TraceRecord`s that follow.
+  std::uint32_t count;
+  // Number of records that the thread discarded since its previous block,
+  // because the flusher had not kept up.
+  std::uint64_t dropped;
+};
+
+static_assert(sizeof(TraceBlockHeader) == 16);
+
+enum TraceKind : std::uint8_t {
+  // A submission queue entry was prepared.
+  TRACE_SQE,
+  // A completion queue entry was reaped.
+  TRACE_CQE,
+  // A synchronous system call returned, e.g. the `recv()` in recvsend mode.
+  TRACE_SYSCALL,
+};
+
+// Names of the values of `IOEntryContext::Operation`, indexed by value.
+inline constexpr const char *trace_operation_names[] = {
+    "TEE",     "SPLICE", "SEND",  "RECV",    "METRICS",
+    "TIMEOUT", "ACCEPT", "CLOSE", "MESSAGE", "RECVMSG",
+    "CONNECT",
+};
+
+struct TraceRecord {
+  // `CLOCK_MONOTONIC` (`std::chrono::steady_clock`) time of the event.
+  std::uint64_t nanoseconds;
+  // Iteration of the forwarding loop during which the event happened.
+  std::uint32_t chunk;
+  // The flags passed with the request for `TRACE_SQE`, or the CQE flags for
+  // `TRACE_CQE`, including the buffer ID in the upper 16 bits.
+  std::uint32_t flags;
+  TraceKind kind;
+  // An `IOEntryContext::Operation`.
+  std::uint8_t op;
+  std::uint16_t reserved;
+  std::int32_t from_fd;
+  std::int32_t to_fd;
+  // Bytes requested.
+  std::uint32_t requested;
+  // The operation's result, i.e. bytes transferred or `-errno`. Zero for
+  // `TRACE_SQE`.
+  std::int32_t result;
+  std::uint32_t reserved2;
+};
+
+static_assert(sizeof(TraceRecord) == 40);
+
+#endif  // TRACE_H_